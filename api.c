@@ -29,6 +29,8 @@
 #include <scsi/scsi.h>
 #include <endian.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "libtcmu_common.h"
 #include "libtcmu_priv.h"
@@ -40,29 +42,29 @@
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
-int tcmu_get_attribute(struct tcmu_device *dev, const char *name)
+static long long read_device_size(struct tcmu_device *dev);
+
+/* Read an attribute straight from configfs */
+static int read_attribute(struct tcmu_device *dev, int dirfd, const char *name)
 {
 	int fd;
-	char path[256];
 	char buf[16];
 	ssize_t ret;
 	unsigned int val;
 
-	snprintf(path, sizeof(path), "/sys/kernel/config/target/core/%s/%s/attrib/%s",
-		 dev->tcm_hba_name, dev->tcm_dev_name, name);
-
-	fd = open(path, O_RDONLY);
+	fd = openat(dirfd, name, O_RDONLY);
 	if (fd == -1) {
 		tcmu_errp(dev->ctx, "Could not open configfs to read attribute %s\n", name);
 		return -EINVAL;
 	}
 
-	ret = read(fd, buf, sizeof(buf));
+	ret = read(fd, buf, sizeof(buf) - 1);
 	close(fd);
 	if (ret == -1) {
 		tcmu_errp(dev->ctx, "Could not read configfs to read attribute %s\n", name);
 		return -EINVAL;
 	}
+	buf[ret] = '\0';
 
 	val = strtoul(buf, NULL, 0);
 	if (val == ULONG_MAX) {
@@ -73,6 +75,131 @@ int tcmu_get_attribute(struct tcmu_device *dev, const char *name)
 	return val;
 }
 
+static int open_attrib_dir(struct tcmu_device *dev)
+{
+	char path[256];
+	int dirfd;
+
+	snprintf(path, sizeof(path), "/sys/kernel/config/target/core/%s/%s/attrib",
+		 dev->tcm_hba_name, dev->tcm_dev_name);
+
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		tcmu_errp(dev->ctx, "Could not open %s\n", path);
+
+	return dirfd;
+}
+
+static struct tcmu_attr *find_attr(struct tcmu_device *dev, const char *name)
+{
+	struct tcmu_attr *attr;
+
+	darray_foreach(attr, dev->attrs) {
+		if (!strcmp(attr->name, name))
+			return attr;
+	}
+
+	return NULL;
+}
+
+/*
+ * Attributes are cached per device, see tcmu_refresh_attributes().
+ * Ones that weren't loaded in bulk are read and cached on first use.
+ */
+int tcmu_get_attribute(struct tcmu_device *dev, const char *name)
+{
+	struct tcmu_attr *attr;
+	struct tcmu_attr new_attr;
+	int dirfd;
+	int val;
+
+	pthread_rwlock_rdlock(&dev->attr_lock);
+	attr = find_attr(dev, name);
+	if (attr)
+		val = attr->val;
+	pthread_rwlock_unlock(&dev->attr_lock);
+	if (attr)
+		return val;
+
+	dirfd = open_attrib_dir(dev);
+	if (dirfd == -1)
+		return -EINVAL;
+	val = read_attribute(dev, dirfd, name);
+	close(dirfd);
+	if (val < 0 || strlen(name) >= sizeof(new_attr.name))
+		return val;
+
+	snprintf(new_attr.name, sizeof(new_attr.name), "%s", name);
+	new_attr.val = val;
+
+	pthread_rwlock_wrlock(&dev->attr_lock);
+	if (!find_attr(dev, name))
+		darray_append(dev->attrs, new_attr);
+	pthread_rwlock_unlock(&dev->attr_lock);
+
+	return val;
+}
+
+/*
+ * Reload every attribute under attrib/ in one pass, plus the device
+ * size, replacing whatever was cached.
+ */
+int tcmu_refresh_attributes(struct tcmu_device *dev)
+{
+	darray_attr attrs = darray_new();
+	struct tcmu_attr attr;
+	struct dirent *dirent;
+	long long size;
+	size_t len;
+	DIR *dir;
+	int dirfd;
+	int val;
+
+	dirfd = open_attrib_dir(dev);
+	if (dirfd == -1)
+		return -EINVAL;
+
+	dir = fdopendir(dirfd);
+	if (!dir) {
+		close(dirfd);
+		return -ENOMEM;
+	}
+
+	while ((dirent = readdir(dir))) {
+		len = strlen(dirent->d_name);
+		if (dirent->d_name[0] == '.' || len >= sizeof(attr.name))
+			continue;
+
+		val = read_attribute(dev, dirfd, dirent->d_name);
+		if (val < 0)
+			continue;
+
+		memcpy(attr.name, dirent->d_name, len + 1);
+		attr.val = val;
+		darray_append(attrs, attr);
+	}
+	closedir(dir);
+
+	size = read_device_size(dev);
+
+	pthread_rwlock_wrlock(&dev->attr_lock);
+	darray_free(dev->attrs);
+	dev->attrs = attrs;
+	dev->size = size;
+	pthread_rwlock_unlock(&dev->attr_lock);
+
+	return 0;
+}
+
+/* Drop cached values, so the next lookups go to configfs */
+void tcmu_invalidate_attributes(struct tcmu_device *dev)
+{
+	pthread_rwlock_wrlock(&dev->attr_lock);
+	darray_free(dev->attrs);
+	darray_init(dev->attrs);
+	dev->size = -1;
+	pthread_rwlock_unlock(&dev->attr_lock);
+}
 
 /*
  * Return a string that contains the device's WWN, or NULL.
@@ -117,7 +244,7 @@ static char *tcmu_get_wwn(struct tcmu_device *dev)
 	return ret_buf;
 }
 
-long long tcmu_get_device_size(struct tcmu_device *dev)
+static long long read_device_size(struct tcmu_device *dev)
 {
 	int fd;
 	char path[256];
@@ -135,13 +262,13 @@ long long tcmu_get_device_size(struct tcmu_device *dev)
 		return -EINVAL;
 	}
 
-	ret = read(fd, buf, sizeof(buf));
+	ret = read(fd, buf, sizeof(buf) - 1);
 	close(fd);
 	if (ret == -1) {
 		tcmu_errp(dev->ctx, "Could not read configfs to read dev info\n");
 		return -EINVAL;
 	}
-	buf[sizeof(buf)-1] = '\0'; /* paranoid? Ensure null terminated */
+	buf[ret] = '\0';
 
 	rover = strstr(buf, " Size: ");
 	if (!rover) {
@@ -159,6 +286,27 @@ long long tcmu_get_device_size(struct tcmu_device *dev)
 	return size;
 }
 
+long long tcmu_get_device_size(struct tcmu_device *dev)
+{
+	long long size;
+
+	pthread_rwlock_rdlock(&dev->attr_lock);
+	size = dev->size;
+	pthread_rwlock_unlock(&dev->attr_lock);
+	if (size >= 0)
+		return size;
+
+	size = read_device_size(dev);
+	if (size < 0)
+		return size;
+
+	pthread_rwlock_wrlock(&dev->attr_lock);
+	dev->size = size;
+	pthread_rwlock_unlock(&dev->attr_lock);
+
+	return size;
+}
+
 int tcmu_get_cdb_length(uint8_t *cdb)
 {
 	uint8_t opcode = cdb[0];
@@ -214,6 +362,84 @@ uint32_t tcmu_get_xfer_length(uint8_t *cdb)
 	}
 }
 
+/*
+ * Fill in the decoded fields of cmd from its cdb and iovec, in one
+ * pass over the opcode. libtcmu does this for every dequeued command;
+ * it's only needed for commands built some other way.
+ */
+void tcmu_decode_cmd(struct tcmulib_cmd *cmd)
+{
+	uint8_t *cdb = cmd->cdb;
+	int cdb_len = tcmu_get_cdb_length(cdb);
+
+	cmd->opcode = cdb[0];
+	cmd->cdb_len = cdb_len > 0 ? cdb_len : 0;
+	cmd->flags = cmd->iov_cnt <= 1 ? TCMULIB_CMD_CONTIGUOUS : 0;
+	cmd->data_len = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+
+	switch (cdb[0]) {
+	case READ_6:
+	case WRITE_6:
+		/* 21-bit LBA, and a transfer length of 0 means 256 blocks */
+		cmd->cmd_class = cdb[0] == READ_6 ?
+			TCMULIB_CMD_READ : TCMULIB_CMD_WRITE;
+		cmd->lba = ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3];
+		cmd->xfer_len = cdb[4] ? cdb[4] : 256;
+		return;
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		cmd->cmd_class = TCMULIB_CMD_READ;
+		break;
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		cmd->cmd_class = TCMULIB_CMD_WRITE;
+		break;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		cmd->cmd_class = TCMULIB_CMD_FLUSH;
+		break;
+	default:
+		cmd->cmd_class = TCMULIB_CMD_OTHER;
+	}
+
+	if (cmd->cmd_class == TCMULIB_CMD_READ ||
+	    cmd->cmd_class == TCMULIB_CMD_WRITE) {
+		/* WRITE AND VERIFY has no FUA, it always writes through */
+		if ((cdb[1] & 0x08) && cdb[0] != WRITE_VERIFY &&
+		    cdb[0] != WRITE_VERIFY_12 && cdb[0] != WRITE_VERIFY_16)
+			cmd->flags |= TCMULIB_CMD_FUA;
+		if (cdb[1] & 0x10)
+			cmd->flags |= TCMULIB_CMD_DPO;
+	}
+
+	switch (cdb_len) {
+	case 6:
+		cmd->lba = 0;
+		cmd->xfer_len = cdb[4];
+		break;
+	case 10:
+		cmd->lba = be32toh(*((u_int32_t *)&cdb[2]));
+		cmd->xfer_len = be16toh(*((uint16_t *)&cdb[7]));
+		break;
+	case 12:
+		cmd->lba = be32toh(*((u_int32_t *)&cdb[2]));
+		cmd->xfer_len = be32toh(*((u_int32_t *)&cdb[6]));
+		break;
+	case 16:
+		cmd->lba = be64toh(*((u_int64_t *)&cdb[2]));
+		cmd->xfer_len = be32toh(*((u_int32_t *)&cdb[10]));
+		break;
+	default:
+		cmd->lba = 0;
+		cmd->xfer_len = 0;
+	}
+}
+
 /*
  * Returns location of first mismatch between bytes in mem and the iovec.
  * If they are the same, return -1.
@@ -31,7 +31,6 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#include <poll.h>
 
 #include <stdint.h>
 #include <scsi/scsi.h>
@@ -60,9 +59,6 @@ void errp(const char *fmt, ...)
 	va_end(va);
 }
 
-struct tcmu_device *tcmu_dev_array[128];
-size_t dev_array_len = 0;
-
 struct foo_state {
 	int fd;
 	uint64_t num_lbas;
@@ -85,10 +81,6 @@ static int foo_open(struct tcmu_device *dev)
 	/* alloc private struct 'foo_state' */
 	/* Save a ptr to it in dev->hm_private */
 
-	/* Add new device to our horrible fixed-length array */
-	tcmu_dev_array[dev_array_len] = dev;
-	dev_array_len++;
-
 	return 0;
 }
 
@@ -163,11 +155,29 @@ static struct tcmulib_handler foo_handler = {
 	.removed = foo_close,
 };
 
+/* Called by tcmulib_run() whenever a device has commands for us */
+static void foo_dev_ready(struct tcmu_device *dev)
+{
+	struct tcmulib_cmd *cmd;
+	int ret;
+
+	tcmulib_processing_start(dev);
+
+	while ((cmd = tcmulib_get_next_command(dev)) != NULL) {
+		ret = foo_handle_cmd(dev,
+				     cmd->cdb,
+				     cmd->iovec,
+				     cmd->iov_cnt,
+				     cmd->sense_buf);
+		tcmulib_command_complete(dev, cmd, ret);
+	}
+
+	tcmulib_processing_complete(dev);
+}
+
 int main(int argc, char **argv)
 {
 	struct tcmulib_context *tcmulib_ctx;
-	struct pollfd pollfds[16];
-	int i;
 	int ret;
 
 	/* If any TCMU devices that exist that match subtype,
@@ -179,55 +189,16 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while (1) {
-		pollfds[0].fd = tcmulib_get_master_fd(tcmulib_ctx);
-		pollfds[0].events = POLLIN;
-		pollfds[0].revents = 0;
-
-		for (i = 0; i < dev_array_len; i++) {
-			pollfds[i+1].fd = tcmu_get_dev_fd(tcmu_dev_array[i]);
-			pollfds[i+1].events = POLLIN;
-			pollfds[i+1].revents = 0;
-		}
-
-		ret = poll(pollfds, dev_array_len+1, -1);
-
-		if (ret <= 0) {
-			errp("poll() returned %d, exiting\n", ret);
-			exit(1);
-		}
-
-		if (pollfds[0].revents) {
-			/* If any tcmu devices have been added or removed, the
-			   added() and removed() handler callbacks will be called
-			   from within this. */
-			tcmulib_master_fd_ready(tcmulib_ctx);
-
-			/* Since devices (may) have changed, re-poll() instead of
-			   processing per-device fds. */
-			continue;
-		}
-
-		for (i = 0; i < dev_array_len; i++) {
-			if (pollfds[i+1].revents) {
-				struct tcmulib_cmd *cmd;
-				struct tcmu_device *dev = tcmu_dev_array[i];
-
-				tcmulib_processing_start(dev);
-
-				while ((cmd = tcmulib_get_next_command(dev)) != NULL) {
-					ret = foo_handle_cmd(dev,
-							     cmd->cdb,
-							     cmd->iovec,
-							     cmd->iov_cnt,
-							     cmd->sense_buf);
-					tcmulib_command_complete(dev, cmd, ret);
-				}
-
-				tcmulib_processing_complete(dev);
-			}
-		}
+	/* Devices that are added or removed later come and go from the
+	   loop by themselves, with added() and removed() called from
+	   within it. */
+	ret = tcmulib_run(tcmulib_ctx, foo_dev_ready);
+	if (ret) {
+		errp("tcmulib_run() returned %d, exiting\n", ret);
+		exit(1);
 	}
 
+	tcmulib_close(tcmulib_ctx);
+
 	return 0;
 }
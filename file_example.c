@@ -42,107 +42,16 @@
 
 #include "tcmu-runner.h"
 
-#ifdef ASYNC_FILE_HANDLER
-#include <pthread.h>
-#include <signal.h>
-#include "libtcmu.h"
-
-#define NHANDLERS 2
-#define NCOMMANDS 16
-
-struct file_handler {
-	struct tcmu_device *dev;
-	int num;
-
-	pthread_mutex_t mtx;
-	pthread_cond_t cond;
-
-	pthread_t thr;
-	int cmd_head;
-	int cmd_tail;
-	struct tcmulib_cmd *commands[NCOMMANDS];
-};
-#endif /* ASYNC_FILE_HANDLER */
-
 struct file_state {
 	int fd;
 	uint64_t num_lbas;
 	uint32_t block_size;
-
-#ifdef ASYNC_FILE_HANDLER
-	pthread_mutex_t completion_mtx;
-	int curr_handler;
-	struct file_handler h[NHANDLERS];
-#endif /* ASYNC_FILE_HANDLER */
 };
 
 #ifdef ASYNC_FILE_HANDLER
 static int file_handle_cmd(
 	struct tcmu_device *dev,
 	struct tcmulib_cmd *tcmulib_cmd);
-
-static void *
-file_handler_run(void *arg)
-{
-	struct file_handler *h = (struct file_handler *) arg;
-	struct file_state *state = tcmu_get_dev_private(h->dev);
-
-	for (;;) {
-		int result;
-		struct tcmulib_cmd *cmd;
-
-		/* get next command */
-		pthread_mutex_lock(&h->mtx);
-		while (h->cmd_tail == h->cmd_head) {
-			pthread_cond_wait(&h->cond, &h->mtx);
-		}
-		cmd = h->commands[h->cmd_tail];
-		pthread_mutex_unlock(&h->mtx);
-
-		/* process command */
-		result = file_handle_cmd(h->dev, cmd);
-		pthread_mutex_lock(&state->completion_mtx);
-		tcmulib_command_complete(h->dev, cmd, result);
-		tcmulib_processing_complete(h->dev);
-		pthread_mutex_unlock(&state->completion_mtx);
-
-		/* notify that we can process more commands */
-		pthread_mutex_lock(&h->mtx);
-		h->commands[h->cmd_tail] = NULL;
-		h->cmd_tail = (h->cmd_tail + 1) % NCOMMANDS;
-		pthread_cond_signal(&h->cond);
-		pthread_mutex_unlock(&h->mtx);
-	}
-
-	return NULL;
-}
-
-static void
-file_handler_init(struct file_handler *h, struct tcmu_device *dev, int num)
-{
-	int i;
-
-	h->dev = dev;
-	h->num = num;
-	pthread_mutex_init(&h->mtx, NULL);
-	pthread_cond_init(&h->cond, NULL);
-
-	pthread_create(&h->thr, NULL, file_handler_run, h);
-	h->cmd_head = h->cmd_tail = 0;
-	for (i = 0; i < NCOMMANDS; i++)
-		h->commands[i] = NULL;
-}
-
-static void
-file_handler_destroy(struct file_handler *h)
-{
-	if (h->thr) {
-		pthread_kill(h->thr, SIGINT);
-		pthread_join(h->thr, NULL);
-	}
-	pthread_cond_destroy(&h->cond);
-	pthread_mutex_destroy(&h->mtx);
-}
 #endif /* ASYNC_FILE_HANDLER */
 
 static bool file_check_config(const char *cfgstring, char **reason)
@@ -179,9 +88,6 @@ static int file_open(struct tcmu_device *dev)
 	struct file_state *state;
 	int64_t size;
 	char *config;
-#ifdef ASYNC_FILE_HANDLER
-	int i;
-#endif /* ASYNC_FILE_HANDLER */
 
 	state = calloc(1, sizeof(*state));
 	if (!state)
@@ -216,12 +122,6 @@ static int file_open(struct tcmu_device *dev)
 		goto err;
 	}
 
-#ifdef ASYNC_FILE_HANDLER
-	pthread_mutex_init(&state->completion_mtx, NULL);
-	for (i = 0; i < NHANDLERS; i++)
-		file_handler_init(&state->h[i], dev, i);
-#endif /* ASYNC_FILE_HANDLER */
-
 	return 0;
 
 err:
@@ -232,13 +132,6 @@ err:
 static void file_close(struct tcmu_device *dev)
 {
 	struct file_state *state = tcmu_get_dev_private(dev);
-#ifdef ASYNC_FILE_HANDLER
-	int i;
-
-	for (i = 0; i < NHANDLERS; i++)
-		file_handler_destroy(&state->h[i]);
-	pthread_mutex_destroy(&state->completion_mtx);
-#endif /* ASYNC_FILE_HANDLER */
 
 	close(state->fd);
 	free(state);
@@ -250,25 +143,15 @@ static int set_medium_error(uint8_t *sense)
 }
 
 #ifdef ASYNC_FILE_HANDLER
+/*
+ * Every command is handed to tcmu-runner's async workers for the
+ * device, which run file_handle_cmd() on it and complete it.
+ */
 static int file_handle_cmd_async(
 	struct tcmu_device *dev,
 	struct tcmulib_cmd *tcmulib_cmd)
 {
-	struct file_state *state = tcmu_get_dev_private(dev);
-	struct file_handler *h = &state->h[state->curr_handler];
-
-	state->curr_handler = (state->curr_handler + 1) % NHANDLERS;
-
-	/* enqueue command */
-	pthread_mutex_lock(&h->mtx);
-	while ((h->cmd_head + 1) % NCOMMANDS == h->cmd_tail) {
-		pthread_cond_wait(&h->cond, &h->mtx);
-	}
-	h->commands[h->cmd_head] = tcmulib_cmd;
-	h->cmd_head = (h->cmd_head + 1) % NCOMMANDS;
-	pthread_cond_signal(&h->cond);
-	pthread_mutex_unlock(&h->mtx);
-
+	tcmur_submit_work(dev, tcmulib_cmd, file_handle_cmd);
 	return TCMU_ASYNC_HANDLED;
 }
 #endif /* ASYNC_FILE_HANDLER */
@@ -289,7 +172,7 @@ static int file_handle_cmd(
 	int remaining;
 	size_t ret;
 
-	cmd = cdb[0];
+	cmd = tcmulib_cmd->opcode;
 
 	switch (cmd) {
 	case INQUIRY:
@@ -320,8 +203,8 @@ static int file_handle_cmd(
 	case READ_16:
 	{
 		void *buf;
-		uint64_t offset = state->block_size * tcmu_get_lba(cdb);
-		int length = tcmu_get_xfer_length(cdb) * state->block_size;
+		uint64_t offset = state->block_size * tcmulib_cmd->lba;
+		int length = tcmulib_cmd->xfer_len * state->block_size;
 
 		/* Using this buf DTRT even if seek is beyond EOF */
 		buf = malloc(length);
@@ -348,8 +231,8 @@ static int file_handle_cmd(
 	case WRITE_12:
 	case WRITE_16:
 	{
-		uint64_t offset = state->block_size * tcmu_get_lba(cdb);
-		int length = be16toh(*((uint16_t *)&cdb[7])) * state->block_size;
+		uint64_t offset = state->block_size * tcmulib_cmd->lba;
+		int length = tcmulib_cmd->xfer_len * state->block_size;
 
 		remaining = length;
 
@@ -378,6 +261,75 @@ static int file_handle_cmd(
 	}
 }
 
+#ifndef ASYNC_FILE_HANDLER
+static int file_read_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  ssize_t ret)
+{
+	struct iovec *iovec = cmd->iovec;
+	size_t iov_cnt = cmd->iov_cnt;
+
+	if (ret < 0) {
+		errp("read failed: %s\n", strerror(-ret));
+		return set_medium_error(cmd->sense_buf);
+	}
+
+	/* Reads beyond EOF return zeroes */
+	for (; iov_cnt; iovec++, iov_cnt--) {
+		if (ret >= iovec->iov_len) {
+			ret -= iovec->iov_len;
+			continue;
+		}
+		memset(iovec->iov_base + ret, 0, iovec->iov_len - ret);
+		ret = 0;
+	}
+
+	return SAM_STAT_GOOD;
+}
+
+static int file_write_done(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			   ssize_t ret)
+{
+	if (ret != cmd->data_len) {
+		errp("Could not write: %s\n",
+		     ret < 0 ? strerror(-ret) : "short write");
+		return set_medium_error(cmd->sense_buf);
+	}
+
+	return SAM_STAT_GOOD;
+}
+
+/*
+ * Reads and writes are handed to tcmu-runner, which batches them on
+ * its io_uring engine if it has one running.
+ */
+static int file_handle_cmd_queued(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd *tcmulib_cmd)
+{
+	struct file_state *state = tcmu_get_dev_private(dev);
+	uint64_t offset = state->block_size * tcmulib_cmd->lba;
+
+	switch (tcmulib_cmd->opcode) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		tcmur_queue_io(dev, tcmulib_cmd, TCMUR_IO_READ, state->fd,
+			       offset, file_read_done);
+		return TCMU_ASYNC_HANDLED;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		tcmur_queue_io(dev, tcmulib_cmd, TCMUR_IO_WRITE, state->fd,
+			       offset, file_write_done);
+		return TCMU_ASYNC_HANDLED;
+	default:
+		return file_handle_cmd(dev, tcmulib_cmd);
+	}
+}
+#endif /* !ASYNC_FILE_HANDLER */
+
 static const char file_cfg_desc[] =
 	"The path to the file to use as a backstore.";
 
@@ -388,19 +340,27 @@ static struct tcmur_handler file_handler = {
 
 	.open = file_open,
 	.close = file_close,
+
+	/* Each device only opens its own file */
+	.parallel_open = true,
 #ifdef ASYNC_FILE_HANDLER
 	.name = "File-backed Handler (example async code)",
 	.subtype = "file_async",
 	.handle_cmd = file_handle_cmd_async,
+	.nr_async_threads = 2,
+	.async_queue_len = 16,
+	/* All it does is hand commands to the async workers */
+	.nonblocking = true,
 #else
 	.name = "File-backed Handler (example code)",
 	.subtype = "file",
-	.handle_cmd = file_handle_cmd,
+	.handle_cmd = file_handle_cmd_queued,
+	.multi_threaded = true,
 #endif
 };
 
 /* Entry point must be named "handler_init". */
 void handler_init(void)
 {
-	tcmur_register_handler(&file_handler);
+	tcmur_register_handler_version(&file_handler, TCMUR_HANDLER_VERSION);
 }
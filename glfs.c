@@ -333,13 +333,13 @@ int tcmu_glfs_handle_cmd(
 	uint32_t length;
 	int result = SAM_STAT_GOOD;
 	char *tmpbuf;
-	uint64_t offset = state->block_size * tcmu_get_lba(cdb);
-	uint32_t tl     = state->block_size * tcmu_get_xfer_length(cdb);
+	uint64_t offset = state->block_size * tcmulib_cmd->lba;
+	uint32_t tl     = state->block_size * tcmulib_cmd->xfer_len;
 	int do_verify = 0;
 	uint32_t cmp_offset;
 	ret = length = 0;
 
-	cmd = cdb[0];
+	cmd = tcmulib_cmd->opcode;
 
 	switch (cmd) {
 	case INQUIRY:
@@ -420,7 +420,7 @@ write:
 
 		if (ret == length) {
 			/* Sync if FUA */
-			if ((cmd != WRITE_6) && (cdb[1] & 0x8))
+			if (tcmulib_cmd->flags & TCMULIB_CMD_FUA)
 				glfs_fdatasync(gfd);
 		} else {
 			errp("Error on write %x %x\n", ret, length);
@@ -509,7 +509,7 @@ write:
 	case READ_10:
 	case READ_12:
 	case READ_16:
-		length = tcmu_iovec_length(iovec, iov_cnt);
+		length = tcmulib_cmd->data_len;
 		ret = glfs_preadv(gfd, iovec, iov_cnt, offset, SEEK_SET);
 
 		if (ret != length) {
@@ -558,10 +558,11 @@ struct tcmur_handler glfs_handler = {
 	.open = tcmu_glfs_open,
 	.close = tcmu_glfs_close,
 	.handle_cmd = tcmu_glfs_handle_cmd,
+	.multi_threaded = true,
 };
 
 /* Entry point must be named "handler_init". */
 void handler_init(void)
 {
-	tcmur_register_handler(&glfs_handler);
+	tcmur_register_handler_version(&glfs_handler, TCMUR_HANDLER_VERSION);
 }
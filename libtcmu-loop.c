@@ -0,0 +1,343 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Built-in epoll event loop, for libtcmu users that don't already have
+ * one. The master fd is registered with it as soon as it exists, the
+ * devices' fds once tcmulib_run() is first called, so programs that
+ * poll the devices themselves don't pay for it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "libtcmu.h"
+#include "libtcmu_priv.h"
+
+/* Max events taken from epoll per wakeup */
+#define TCMU_LOOP_EVENTS 64
+
+static int loop_add(struct tcmulib_context *ctx, struct tcmu_loop_source *src)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) == -1) {
+		tcmu_errp(ctx, "could not add fd %d to event loop: %m\n", src->fd);
+		return -errno;
+	}
+
+	return 0;
+}
+
+int tcmu_loop_init(struct tcmulib_context *ctx)
+{
+	int ret;
+
+	darray_init(ctx->loop_sources);
+	darray_init(ctx->loop_dead);
+	darray_init(ctx->coalescing);
+	pthread_mutex_init(&ctx->coalescing_lock, NULL);
+
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd == -1) {
+		tcmu_errp(ctx, "could not create event loop: %m\n");
+		return -errno;
+	}
+
+	ctx->wake_src.type = TCMU_LOOP_WAKE;
+	ctx->wake_src.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->wake_src.fd == -1) {
+		tcmu_errp(ctx, "could not create event loop eventfd: %m\n");
+		ret = -errno;
+		goto err_close_epoll;
+	}
+
+	ret = loop_add(ctx, &ctx->wake_src);
+	if (ret)
+		goto err_close_wake;
+
+	ctx->master_src.type = TCMU_LOOP_MASTER;
+	ctx->master_src.fd = tcmulib_get_master_fd(ctx);
+	ret = loop_add(ctx, &ctx->master_src);
+	if (ret)
+		goto err_close_wake;
+
+	return 0;
+
+err_close_wake:
+	close(ctx->wake_src.fd);
+err_close_epoll:
+	close(ctx->epoll_fd);
+	pthread_mutex_destroy(&ctx->coalescing_lock);
+	return ret;
+}
+
+static void free_dead_sources(struct tcmulib_context *ctx)
+{
+	struct tcmu_loop_source **src;
+
+	darray_foreach(src, ctx->loop_dead)
+		free(*src);
+	darray_resize(ctx->loop_dead, 0);
+}
+
+void tcmu_loop_exit(struct tcmulib_context *ctx)
+{
+	struct tcmu_loop_source **src;
+
+	darray_foreach(src, ctx->loop_sources)
+		free(*src);
+	darray_free(ctx->loop_sources);
+
+	free_dead_sources(ctx);
+	darray_free(ctx->loop_dead);
+
+	darray_free(ctx->coalescing);
+	pthread_mutex_destroy(&ctx->coalescing_lock);
+
+	close(ctx->wake_src.fd);
+	close(ctx->epoll_fd);
+}
+
+/* Main thread only, like adding and removing devices */
+int tcmu_loop_add_device(struct tcmu_device *dev)
+{
+	if (!dev->ctx->loop_devices)
+		return 0;
+
+	dev->loop_src.type = TCMU_LOOP_DEVICE;
+	dev->loop_src.fd = dev->fd;
+	dev->loop_src.data = dev;
+
+	return loop_add(dev->ctx, &dev->loop_src);
+}
+
+void tcmu_loop_del_device(struct tcmu_device *dev)
+{
+	if (dev->ctx->loop_devices)
+		epoll_ctl(dev->ctx->epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+}
+
+/* Add the devices there already are, the rest are added as they come */
+static int loop_add_devices(struct tcmulib_context *ctx)
+{
+	struct tcmu_device **dev_ptr;
+	int ret;
+
+	ctx->loop_devices = true;
+
+	darray_foreach(dev_ptr, ctx->devices) {
+		ret = tcmu_loop_add_device(*dev_ptr);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Put the device on the list the loop flushes notifications for, or
+ * take it off. Any thread may coalesce notifications, and at any time.
+ */
+void tcmu_loop_coalescing(struct tcmu_device *dev, bool on)
+{
+	struct tcmulib_context *ctx = dev->ctx;
+	struct tcmu_device *last;
+
+	pthread_mutex_lock(&ctx->coalescing_lock);
+
+	if (on && !dev->on_coalescing) {
+		dev->coalescing_index = darray_size(ctx->coalescing);
+		darray_append(ctx->coalescing, dev);
+		dev->on_coalescing = true;
+	} else if (!on && dev->on_coalescing) {
+		/* Order doesn't matter, fill the hole with the last one */
+		last = darray_item(ctx->coalescing, darray_size(ctx->coalescing) - 1);
+		darray_item(ctx->coalescing, dev->coalescing_index) = last;
+		last->coalescing_index = dev->coalescing_index;
+		darray_resize(ctx->coalescing, darray_size(ctx->coalescing) - 1);
+		dev->on_coalescing = false;
+	}
+
+	pthread_mutex_unlock(&ctx->coalescing_lock);
+}
+
+int tcmulib_add_fd(struct tcmulib_context *ctx, int fd,
+		   void (*cb)(int fd, void *data), void *data)
+{
+	struct tcmu_loop_source *src;
+	int ret;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return -ENOMEM;
+
+	src->type = TCMU_LOOP_USER;
+	src->fd = fd;
+	src->cb = cb;
+	src->data = data;
+
+	ret = loop_add(ctx, src);
+	if (ret) {
+		free(src);
+		return ret;
+	}
+
+	darray_append(ctx->loop_sources, src);
+
+	return 0;
+}
+
+int tcmulib_del_fd(struct tcmulib_context *ctx, int fd)
+{
+	struct tcmu_loop_source *src;
+	int i;
+
+	for (i = 0; i < darray_size(ctx->loop_sources); i++) {
+		src = darray_item(ctx->loop_sources, i);
+		if (src->fd != fd)
+			continue;
+
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		darray_remove(ctx->loop_sources, i);
+
+		/*
+		 * Its event may still be pending in the batch being
+		 * dispatched, so only free it once that's done.
+		 */
+		src->fd = -1;
+		darray_append(ctx->loop_dead, src);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Flush notifications that were held back past their deadline, and
+ * work out how long epoll may sleep before the next one is due.
+ */
+static int flush_notifications(struct tcmulib_context *ctx)
+{
+	struct tcmu_device **dev_ptr;
+	int timeout = -1;
+	int dev_timeout;
+
+	pthread_mutex_lock(&ctx->coalescing_lock);
+
+	darray_foreach(dev_ptr, ctx->coalescing) {
+		dev_timeout = tcmulib_get_notify_timeout(*dev_ptr);
+		if (dev_timeout == 0) {
+			tcmulib_processing_complete(*dev_ptr);
+			dev_timeout = tcmulib_get_notify_timeout(*dev_ptr);
+		}
+		if (dev_timeout < 0)
+			continue;
+
+		/* epoll only does milliseconds, round up */
+		dev_timeout = (dev_timeout + 999) / 1000;
+		if (timeout < 0 || dev_timeout < timeout)
+			timeout = dev_timeout;
+	}
+
+	pthread_mutex_unlock(&ctx->coalescing_lock);
+
+	return timeout;
+}
+
+int tcmulib_run(struct tcmulib_context *ctx,
+		void (*dev_ready)(struct tcmu_device *dev))
+{
+	struct epoll_event events[TCMU_LOOP_EVENTS];
+	struct tcmu_loop_source *src;
+	bool master_ready;
+	uint64_t val;
+	int timeout;
+	int nr_events;
+	int ret;
+	int i;
+
+	if (!ctx->loop_devices) {
+		ret = loop_add_devices(ctx);
+		if (ret)
+			return ret;
+	}
+
+	while (!__atomic_load_n(&ctx->loop_stop, __ATOMIC_ACQUIRE)) {
+		timeout = flush_notifications(ctx);
+
+		nr_events = epoll_wait(ctx->epoll_fd, events, TCMU_LOOP_EVENTS, timeout);
+		if (nr_events == -1) {
+			if (errno == EINTR)
+				continue;
+			tcmu_errp(ctx, "epoll_wait failed: %m\n");
+			return -errno;
+		}
+
+		master_ready = false;
+		for (i = 0; i < nr_events; i++) {
+			src = events[i].data.ptr;
+
+			switch (src->type) {
+			case TCMU_LOOP_MASTER:
+				master_ready = true;
+				break;
+			case TCMU_LOOP_WAKE:
+				if (read(src->fd, &val, sizeof(val)) == -1 &&
+				    errno != EAGAIN)
+					tcmu_errp(ctx, "could not clear event loop eventfd: %m\n");
+				break;
+			case TCMU_LOOP_DEVICE:
+				dev_ready(src->data);
+				break;
+			case TCMU_LOOP_USER:
+				if (src->fd != -1)
+					src->cb(src->fd, src->data);
+				break;
+			}
+		}
+
+		/*
+		 * Devices may be removed in here, so only once their
+		 * events from this batch have been dispatched.
+		 */
+		if (master_ready)
+			tcmulib_master_fd_ready(ctx);
+
+		free_dead_sources(ctx);
+	}
+
+	__atomic_store_n(&ctx->loop_stop, false, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void tcmulib_stop(struct tcmulib_context *ctx)
+{
+	uint64_t val = 1;
+
+	__atomic_store_n(&ctx->loop_stop, true, __ATOMIC_RELEASE);
+
+	if (write(ctx->wake_src.fd, &val, sizeof(val)) == -1)
+		tcmu_errp(ctx, "could not wake event loop: %m\n");
+}
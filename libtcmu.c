@@ -26,6 +26,8 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 #include <scsi/scsi.h>
 
 #include <linux/target_core_user.h>
@@ -36,6 +38,7 @@
 
 #include "libtcmu.h"
 #include "libtcmu_priv.h"
+#include "tcmu-probes.h"
 
 #define ARRAY_SIZE(X) (sizeof(X) / sizeof((X)[0]))
 
@@ -154,6 +157,14 @@ static void teardown_netlink(struct nl_sock *sock)
 	nl_socket_free(sock);
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static struct tcmulib_handler *find_handler(struct tcmulib_context *ctx,
 					    char *cfgstring)
 {
@@ -172,26 +183,105 @@ static struct tcmulib_handler *find_handler(struct tcmulib_context *ctx,
 	return NULL;
 }
 
-static int add_device(struct tcmulib_context *ctx,
-		      char *dev_name, char *cfgstring)
+struct tcmu_device *tcmulib_lookup_dev(struct tcmulib_context *ctx,
+				       unsigned int minor)
+{
+	struct tcmu_device **chunk;
+
+	if (minor >= TCMU_MAX_MINORS)
+		return NULL;
+
+	chunk = __atomic_load_n(&ctx->dev_chunks[minor >> TCMU_DEV_CHUNK_SHIFT],
+				__ATOMIC_ACQUIRE);
+	if (!chunk)
+		return NULL;
+
+	return __atomic_load_n(&chunk[minor & (TCMU_DEV_CHUNK - 1)],
+			       __ATOMIC_ACQUIRE);
+}
+
+static int register_device(struct tcmulib_context *ctx, struct tcmu_device *dev)
+{
+	struct tcmu_device ***chunk = &ctx->dev_chunks[dev->minor >> TCMU_DEV_CHUNK_SHIFT];
+
+	if (!*chunk) {
+		struct tcmu_device **new_chunk;
+
+		new_chunk = calloc(TCMU_DEV_CHUNK, sizeof(*new_chunk));
+		if (!new_chunk)
+			return -ENOMEM;
+		__atomic_store_n(chunk, new_chunk, __ATOMIC_RELEASE);
+	}
+
+	/* Published fully set up */
+	__atomic_store_n(&(*chunk)[dev->minor & (TCMU_DEV_CHUNK - 1)], dev,
+			 __ATOMIC_RELEASE);
+
+	dev->index = darray_size(ctx->devices);
+	darray_append(ctx->devices, dev);
+
+	return 0;
+}
+
+static void unregister_device(struct tcmulib_context *ctx, struct tcmu_device *dev)
+{
+	struct tcmu_device **chunk = ctx->dev_chunks[dev->minor >> TCMU_DEV_CHUNK_SHIFT];
+	struct tcmu_device *last;
+
+	__atomic_store_n(&chunk[dev->minor & (TCMU_DEV_CHUNK - 1)], NULL,
+			 __ATOMIC_RELEASE);
+
+	/* Order doesn't matter, fill the hole with the last one */
+	last = darray_item(ctx->devices, darray_size(ctx->devices) - 1);
+	darray_item(ctx->devices, dev->index) = last;
+	last->index = dev->index;
+	darray_resize(ctx->devices, darray_size(ctx->devices) - 1);
+}
+
+static void free_device(struct tcmu_device *dev)
+{
+	darray_free(dev->attrs);
+	pthread_rwlock_destroy(&dev->attr_lock);
+	free(dev);
+}
+
+/*
+ * Adding a device takes three steps: parse_device() and
+ * publish_device() must run on the main thread, but open_device(),
+ * which calls the handler's added(), may run elsewhere.
+ */
+static struct tcmu_device *parse_device(struct tcmulib_context *ctx,
+					char *dev_name, char *cfgstring)
 {
 	struct tcmu_device *dev;
-	struct tcmu_mailbox *mb;
-	char str_buf[256];
-	int fd;
-	int ret;
 	char *ptr, *oldptr;
-	char *reason = NULL;
 	int len;
 
 	dev = calloc(1, sizeof(*dev));
 	if (!dev) {
 		tcmu_errp(ctx, "calloc failed in add_device\n");
-		return -ENOMEM;
+		return NULL;
 	}
 
+	dev->ctx = ctx;
+	dev->fd = -1;
+	pthread_rwlock_init(&dev->attr_lock, NULL);
+	darray_init(dev->attrs);
+	dev->size = -1;
+
 	snprintf(dev->dev_name, sizeof(dev->dev_name), "%s", dev_name);
 
+	if (sscanf(dev_name, "uio%u", &dev->minor) != 1 ||
+	    dev->minor >= TCMU_MAX_MINORS) {
+		tcmu_errp(ctx, "invalid device name %s\n", dev_name);
+		goto err_free;
+	}
+
+	if (tcmulib_lookup_dev(ctx, dev->minor)) {
+		tcmu_errp(ctx, "device %s already added\n", dev_name);
+		goto err_free;
+	}
+
 	oldptr = cfgstring;
 	ptr = strchr(oldptr, '/');
 	if (!ptr) {
@@ -235,6 +325,59 @@ static int add_device(struct tcmulib_context *ctx,
 		goto err_free;
 	}
 
+	return dev;
+
+err_free:
+	free_device(dev);
+	return NULL;
+}
+
+/*
+ * Take the device from the process serving it, if it has it, see
+ * tcmulib_initialize_handover()
+ */
+static void claim_device(struct tcmu_device *dev)
+{
+	struct tcmulib_context *ctx = dev->ctx;
+	struct tcmulib_handover h;
+	char uio_name[sizeof(h.uio_name)];
+	int ret;
+
+	ret = ctx->claim(dev->dev_name, &h, ctx->claim_data);
+	if (ret) {
+		if (ret < 0)
+			tcmu_errp(ctx, "%s: could not take over device: %d\n",
+				  dev->dev_name, ret);
+		return;
+	}
+
+	/*
+	 * The one we found, not one that got its minor after it was
+	 * removed. As tcmulib_handover_device() names it.
+	 */
+	snprintf(uio_name, sizeof(uio_name), "tcm-user/%s/%s/%s",
+		 dev->tcm_hba_name + 5, dev->tcm_dev_name, dev->cfgstring);
+	if (strcmp(uio_name, h.uio_name)) {
+		tcmu_errp(ctx, "%s: handed over device has gone\n", dev->dev_name);
+		close(h.fd);
+		return;
+	}
+
+	dev->fd = h.fd;
+	dev->handed_over = true;
+	dev->handover_tail = h.cmd_tail;
+}
+
+/* Frees dev on failure */
+static int open_device(struct tcmu_device *dev)
+{
+	struct tcmulib_context *ctx = dev->ctx;
+	struct tcmu_mailbox *mb;
+	char str_buf[256];
+	int fd;
+	int ret;
+	char *reason = NULL;
+
 	if (!dev->handler->check_config(dev->cfgstring, &reason)) {
 		/* It may be handled by other handlers */
 		tcmu_errp(ctx, "check_config failed for %s because of %s\n", dev->dev_name, reason);
@@ -242,12 +385,23 @@ static int add_device(struct tcmulib_context *ctx,
 		goto err_free;
 	}
 
-	snprintf(str_buf, sizeof(str_buf), "/dev/%s", dev_name);
+	/* tcmu-sim devices come with their ring already mapped */
+	if (dev_is_sim(dev))
+		goto mapped;
 
-	dev->fd = open(str_buf, O_RDWR | O_NONBLOCK | O_CLOEXEC);
-	if (dev->fd == -1) {
-		tcmu_errp(ctx, "could not open %s\n", str_buf);
-		goto err_free;
+	/* Only now, so the process serving it stops as late as it can */
+	if (ctx->claim)
+		claim_device(dev);
+
+	/* A handed over device comes with its fd */
+	if (!dev->handed_over) {
+		snprintf(str_buf, sizeof(str_buf), "/dev/%s", dev->dev_name);
+
+		dev->fd = open(str_buf, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (dev->fd == -1) {
+			tcmu_errp(ctx, "could not open %s\n", str_buf);
+			goto err_free;
+		}
 	}
 
 	snprintf(str_buf, sizeof(str_buf), "/sys/class/uio/%s/maps/map0/size", dev->dev_name);
@@ -277,6 +431,10 @@ static int add_device(struct tcmulib_context *ctx,
 		goto err_fd_close;
 	}
 
+	/* So handlers' added() finds attributes without going to configfs */
+	tcmu_refresh_attributes(dev);
+
+mapped:
 	mb = dev->map;
 	if (mb->version != KERN_IFACE_VER) {
 		tcmu_errp(ctx, "Kernel interface version mismatch: wanted %d got %d\n",
@@ -285,93 +443,291 @@ static int add_device(struct tcmulib_context *ctx,
 	}
 	dev->cmd_tail = mb->cmd_tail;
 
-	dev->ctx = ctx;
+	/* The old process completes everything it took, so these agree */
+	if (dev->handed_over && dev->handover_tail != dev->cmd_tail)
+		tcmu_errp(ctx, "%s: handed over at cmd_tail %u but the ring is at %u\n",
+			  dev->dev_name, dev->handover_tail, dev->cmd_tail);
+
+	/*
+	 * A command takes at least one full entry on the ring, so this
+	 * bounds how many can be outstanding at once.
+	 */
+	dev->nr_slots = mb->cmdr_size / sizeof(struct tcmu_cmd_entry);
+	dev->slots = calloc(dev->nr_slots, sizeof(*dev->slots));
+	if (!dev->slots) {
+		tcmu_errp(ctx, "could not allocate command slots for %s\n", dev->dev_name);
+		goto err_munmap;
+	}
 
-	darray_append(ctx->devices, dev);
+	/* Not worth failing the device over, added() may also change it */
+	if (tcmulib_set_trace_size(dev, TCMULIB_TRACE_DEFAULT))
+		tcmu_errp(ctx, "could not allocate command trace for %s\n", dev->dev_name);
 
 	ret = dev->handler->added(dev);
 	if (ret < 0) {
 		tcmu_errp(ctx, "handler open failed for %s\n", dev->dev_name);
-		goto err_munmap;
+		goto err_free_slots;
 	}
 
 	return 0;
 
+err_free_slots:
+	/* added() may have turned coalescing on before it failed */
+	tcmu_loop_coalescing(dev, false);
+	free(dev->trace);
+	free(dev->slots);
 err_munmap:
+	if (dev_is_sim(dev))
+		goto err_free;
 	munmap(dev->map, dev->map_len);
 err_fd_close:
 	close(dev->fd);
 err_free:
-	free(dev);
+	free_device(dev);
 
 	return -ENOENT;
 }
 
+static void close_device(struct tcmu_device *dev)
+{
+	/* The built-in loop has its deadlines to keep no more */
+	tcmu_loop_coalescing(dev, false);
+
+	/* The simulator owns a tcmu-sim device's ring and fd */
+	if (!dev_is_sim(dev)) {
+		munmap(dev->map, dev->map_len);
+		close(dev->fd);
+	}
+	free(dev->trace);
+	free(dev->slots);
+	free_device(dev);
+}
+
+/* Make an opened device visible; removes and frees it on failure */
+static int publish_device(struct tcmu_device *dev)
+{
+	int ret;
+
+	ret = tcmu_loop_add_device(dev);
+	if (ret)
+		goto err_removed;
+
+	ret = register_device(dev->ctx, dev);
+	if (ret) {
+		tcmu_loop_del_device(dev);
+		goto err_removed;
+	}
+
+	return 0;
+
+err_removed:
+	dev->handler->removed(dev);
+	close_device(dev);
+	return ret;
+}
+
+static int add_device(struct tcmulib_context *ctx,
+		      char *dev_name, char *cfgstring)
+{
+	struct tcmu_device *dev;
+	int ret;
+
+	dev = parse_device(ctx, dev_name, cfgstring);
+	if (!dev)
+		return -ENOENT;
+
+	ret = open_device(dev);
+	if (ret)
+		return ret;
+
+	return publish_device(dev);
+}
+
 static void remove_device(struct tcmulib_context *ctx,
 			  char *dev_name, char *cfgstring)
 {
-	struct tcmu_device **dev_ptr;
-	struct tcmu_device *dev;
-	int i = 0;
-	bool found = false;
-
-	darray_foreach(dev_ptr, ctx->devices) {
-		dev = *dev_ptr;
-		size_t len = strnlen(dev->dev_name, sizeof(dev->dev_name));
-		if (strncmp(dev->dev_name, dev_name, len)) {
-			i++;
-		} else {
-			found = true;
-			break;
-		}
-	}
+	struct tcmu_device *dev = NULL;
+	unsigned int minor;
+
+	if (sscanf(dev_name, "uio%u", &minor) == 1)
+		dev = tcmulib_lookup_dev(ctx, minor);
 
-	if (!found) {
+	if (!dev) {
 		tcmu_errp(ctx, "could not remove device %s: not found\n", dev_name);
 		return;
 	}
 
+	tcmu_loop_del_device(dev);
+	unregister_device(ctx, dev);
+
 	dev->handler->removed(dev);
 
-	darray_remove(ctx->devices, i);
+	close_device(dev);
+}
+
+#ifdef TCMU_SIM
+/*
+ * tcmu-sim plays the kernel's part for tcmu-bench: it lays out a
+ * mailbox, ring and data area in memory it owns and gives us one end
+ * of a socketpair to use as the uio fd. Such devices skip uio,
+ * configfs and the event loop; the block size and device size the
+ * handler will ask for are seeded in the attribute cache instead.
+ */
+struct tcmulib_context *tcmu_sim_initialize(struct tcmulib_handler *handlers,
+					    size_t handler_count,
+					    void (*err_print)(const char *fmt, ...))
+{
+	struct tcmulib_context *ctx;
+	int i;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->err_print = err_print;
+	ctx->epoll_fd = -1;
+	pthread_mutex_init(&ctx->coalescing_lock, NULL);
+	darray_init(ctx->coalescing);
+	darray_init(ctx->handlers);
+	darray_init(ctx->devices);
+
+	for (i = 0; i < handler_count; i++) {
+		struct tcmulib_handler handler = handlers[i];
+		handler.ctx = ctx;
+		darray_append(ctx->handlers, handler);
+	}
+
+	return ctx;
+}
+
+void tcmu_sim_close(struct tcmulib_context *ctx)
+{
+	int i;
+
+	darray_free(ctx->coalescing);
+	pthread_mutex_destroy(&ctx->coalescing_lock);
+	darray_free(ctx->handlers);
+	darray_free(ctx->devices);
+	for (i = 0; i < TCMU_DEV_CHUNKS; i++)
+		free(ctx->dev_chunks[i]);
+	free(ctx);
+}
+
+struct tcmu_device *tcmu_sim_add_device(struct tcmulib_context *ctx,
+					char *dev_name, char *cfgstring,
+					int fd, void *map, size_t map_len,
+					int block_size, long long size)
+{
+	struct tcmu_attr attr = { .name = "hw_block_size", .val = block_size };
+	struct tcmu_device *dev;
+
+	dev = parse_device(ctx, dev_name, cfgstring);
+	if (!dev)
+		return NULL;
+
+	dev->sim = true;
+	dev->fd = fd;
+	dev->map = map;
+	dev->map_len = map_len;
+	darray_append(dev->attrs, attr);
+	dev->size = size;
+
+	if (open_device(dev))
+		return NULL;
+
+	if (register_device(ctx, dev)) {
+		dev->handler->removed(dev);
+		close_device(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+void tcmu_sim_remove_device(struct tcmu_device *dev)
+{
+	unregister_device(dev->ctx, dev);
+	dev->handler->removed(dev);
+	close_device(dev);
 }
+#endif
 
 static int is_uio(const struct dirent *dirent)
 {
-	int fd;
+	return !strncmp(dirent->d_name, "uio", 3);
+}
+
+/*
+ * Read a uio device's name into buf. Returns false if it isn't one of
+ * ours.
+ */
+static bool read_uio_name(struct tcmulib_context *ctx, const char *dev_name,
+			  char *buf, size_t len)
+{
 	char tmp_path[64];
-	char buf[256];
 	ssize_t ret;
+	int fd;
 
-	if (strncmp(dirent->d_name, "uio", 3))
-		return 0;
-
-	snprintf(tmp_path, sizeof(tmp_path), "/sys/class/uio/%s/name", dirent->d_name);
+	snprintf(tmp_path, sizeof(tmp_path), "/sys/class/uio/%s/name", dev_name);
 
 	fd = open(tmp_path, O_RDONLY);
-	if (fd == -1)
-		return 0;
-
-	ret = read(fd, buf, sizeof(buf));
-	if (ret <= 0 || ret >= sizeof(buf))
-		goto not_uio;
+	if (fd == -1) {
+		tcmu_errp(ctx, "could not open %s!\n", tmp_path);
+		return false;
+	}
 
+	ret = read(fd, buf, len);
+	close(fd);
+	if (ret <= 0 || ret >= len) {
+		tcmu_errp(ctx, "read of %s had issues\n", tmp_path);
+		return false;
+	}
 	buf[ret-1] = '\0'; /* null-terminate and chop off the \n */
 
 	/* we only want uio devices whose name is a format we expect */
-	if (strncmp(buf, "tcm-user", 8))
-		goto not_uio;
+	return !strncmp(buf, "tcm-user", 8);
+}
 
-	close(fd);
-	return 1;
-not_uio:
-	close(fd);
-	return 0;
+/*
+ * Devices found at startup whose handlers allow it are opened this
+ * many at a time. added() can take a while, e.g. to connect to remote
+ * storage, so this is about overlapping waits more than using CPUs.
+ */
+#define TCMU_OPEN_THREADS 16
+
+struct open_work {
+	struct tcmu_device **devs;
+	int *results;
+	int nr_devs;
+	int next;		/* next index to claim */
+	bool parallel;		/* only take devs whose handler allows it */
+};
+
+static void *open_devices_worker(void *arg)
+{
+	struct open_work *work = arg;
+	struct tcmu_device *dev;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->nr_devs) {
+		dev = work->devs[i];
+		if (dev->handler->parallel_added != work->parallel)
+			continue;
+
+		work->results[i] = open_device(dev);
+	}
+
+	return NULL;
 }
 
 static int open_devices(struct tcmulib_context *ctx)
 {
 	struct dirent **dirent_list;
+	struct open_work work = { 0 };
+	pthread_t threads[TCMU_OPEN_THREADS];
+	int nr_threads = 0;
+	int nr_parallel = 0;
+	int nr_handed_over = 0;
 	int num_devs;
 	int num_good_devs = 0;
 	int i;
@@ -381,36 +737,62 @@ static int open_devices(struct tcmulib_context *ctx)
 	if (num_devs == -1)
 		return -1;
 
+	work.devs = calloc(num_devs, sizeof(*work.devs));
+	work.results = calloc(num_devs, sizeof(*work.results));
+	if (num_devs && (!work.devs || !work.results)) {
+		num_good_devs = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < num_devs; i++) {
-		char tmp_path[64];
 		char buf[256];
-		int fd;
-		int ret;
+		struct tcmu_device *dev;
 
-		snprintf(tmp_path, sizeof(tmp_path), "/sys/class/uio/%s/name",
-			 dirent_list[i]->d_name);
-
-		fd = open(tmp_path, O_RDONLY);
-		if (fd == -1) {
-			tcmu_errp(ctx, "could not open %s!\n", tmp_path);
+		if (!read_uio_name(ctx, dirent_list[i]->d_name, buf, sizeof(buf)))
 			continue;
-		}
 
-		ret = read(fd, buf, sizeof(buf));
-		close(fd);
-		if (ret <= 0 || ret >= sizeof(buf)) {
-			tcmu_errp(ctx, "read of %s had issues\n", tmp_path);
+		dev = parse_device(ctx, dirent_list[i]->d_name, buf);
+		if (!dev)
 			continue;
-		}
-		buf[ret-1] = '\0'; /* null-terminate and chop off the \n */
 
-		ret = add_device(ctx, dirent_list[i]->d_name, buf);
-		if (ret < 0)
-			continue;
+		work.devs[work.nr_devs++] = dev;
+		if (dev->handler->parallel_added)
+			nr_parallel++;
+	}
 
+	/* Those whose handlers allow it first, in parallel */
+	work.parallel = true;
+	for (; nr_threads < TCMU_OPEN_THREADS && nr_threads < nr_parallel; nr_threads++) {
+		if (pthread_create(&threads[nr_threads], NULL,
+				   open_devices_worker, &work))
+			break;
+	}
+	/* Does them all itself if it couldn't start any threads */
+	if (nr_parallel && !nr_threads)
+		open_devices_worker(&work);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Then the rest, one at a time */
+	work.parallel = false;
+	work.next = 0;
+	open_devices_worker(&work);
+
+	for (i = 0; i < work.nr_devs; i++) {
+		if (work.results[i] || publish_device(work.devs[i]))
+			continue;
 		num_good_devs++;
+		if (work.devs[i]->handed_over)
+			nr_handed_over++;
 	}
 
+	if (num_good_devs < work.nr_devs)
+		tcmu_errp(ctx, "could only open %d of %d devices (%d handed over)\n",
+			  num_good_devs, work.nr_devs, nr_handed_over);
+
+out:
+	free(work.results);
+	free(work.devs);
 	for (i = 0; i < num_devs; i++)
 		free(dirent_list[i]);
 	free(dirent_list);
@@ -422,6 +804,17 @@ struct tcmulib_context *tcmulib_initialize(
 	struct tcmulib_handler *handlers,
 	size_t handler_count,
 	void (*err_print)(const char *fmt, ...))
+{
+	return tcmulib_initialize_handover(handlers, handler_count, err_print,
+					   NULL, NULL);
+}
+
+struct tcmulib_context *tcmulib_initialize_handover(
+	struct tcmulib_handler *handlers,
+	size_t handler_count,
+	void (*err_print)(const char *fmt, ...),
+	tcmulib_claim_fn claim,
+	void *data)
 {
 	struct tcmulib_context *ctx;
 	int ret;
@@ -434,6 +827,7 @@ struct tcmulib_context *tcmulib_initialize(
 	// Stash this away early, so that debug output works from here forth
 	ctx->err_print = err_print;
 
+	/* Before looking at devices, so none that come or go meanwhile are missed */
 	ctx->nl_sock = setup_netlink(ctx);
 	if (!ctx->nl_sock) {
 		free(ctx);
@@ -449,22 +843,40 @@ struct tcmulib_context *tcmulib_initialize(
 		darray_append(ctx->handlers, handler);
 	}
 
+	ret = tcmu_loop_init(ctx);
+	if (ret < 0)
+		goto err_free;
+
+	/* Devices that show up later are new, nobody else has them */
+	ctx->claim = claim;
+	ctx->claim_data = data;
 	ret = open_devices(ctx);
+	ctx->claim = NULL;
 	if (ret < 0) {
-		teardown_netlink(ctx->nl_sock);
-		darray_free(ctx->handlers);
-		darray_free(ctx->devices);
-		return NULL;
+		tcmu_loop_exit(ctx);
+		goto err_free;
 	}
 
 	return ctx;
+
+err_free:
+	teardown_netlink(ctx->nl_sock);
+	darray_free(ctx->handlers);
+	darray_free(ctx->devices);
+	free(ctx);
+	return NULL;
 }
 
 void tcmulib_close(struct tcmulib_context *ctx)
 {
+	int i;
+
+	tcmu_loop_exit(ctx);
 	teardown_netlink(ctx->nl_sock);
 	darray_free(ctx->handlers);
 	darray_free(ctx->devices);
+	for (i = 0; i < TCMU_DEV_CHUNKS; i++)
+		free(ctx->dev_chunks[i]);
 	free(ctx);
 }
 
@@ -488,6 +900,21 @@ void tcmu_set_dev_private(struct tcmu_device *dev, void *private)
 	dev->hm_private = private;
 }
 
+void *tcmulib_get_dev_data(struct tcmu_device *dev)
+{
+	return dev->app_private;
+}
+
+void tcmulib_set_dev_data(struct tcmu_device *dev, void *data)
+{
+	dev->app_private = data;
+}
+
+unsigned int tcmu_get_dev_minor(struct tcmu_device *dev)
+{
+	return dev->minor;
+}
+
 int tcmu_get_dev_fd(struct tcmu_device *dev)
 {
 	return dev->fd;
@@ -504,85 +931,291 @@ struct tcmulib_handler *tcmu_get_dev_handler(struct tcmu_device *dev)
 }
 
 static inline struct tcmu_cmd_entry *
-device_cmd_head(struct tcmu_device *dev)
+device_cmd_tail(struct tcmu_device *dev)
 {
 	struct tcmu_mailbox *mb = dev->map;
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + mb->cmd_head);
+	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + dev->cmd_tail);
 }
 
-static inline struct tcmu_cmd_entry *
-device_cmd_tail(struct tcmu_device *dev)
+static struct tcmu_cmd_slot *
+alloc_cmd_slot(struct tcmu_device *dev, unsigned iov_cnt, unsigned cdb_len)
+{
+	struct tcmu_cmd_slot *slot;
+
+	if (iov_cnt > TCMU_CMD_SLOT_IOVS || cdb_len > TCMU_CMD_SLOT_CDB_LEN)
+		goto fallback;
+
+	if (!dev->free_slots)
+		dev->free_slots = __atomic_exchange_n(&dev->returned_slots, NULL,
+						      __ATOMIC_ACQUIRE);
+
+	slot = dev->free_slots;
+	if (slot)
+		dev->free_slots = slot->next;
+	else if (dev->slots_used < dev->nr_slots)
+		slot = &dev->slots[dev->slots_used++];
+	else
+		goto fallback;
+
+	slot->pooled = true;
+	slot->cmd.iovec = slot->iovec;
+	slot->cmd.cdb = slot->cdb;
+
+	return slot;
+
+fallback:
+	slot = malloc(sizeof(*slot) + sizeof(struct iovec) * iov_cnt + cdb_len);
+	if (!slot)
+		return NULL;
+
+	slot->pooled = false;
+	slot->cmd.iovec = (struct iovec *) (slot + 1);
+	slot->cmd.cdb = (uint8_t *) (slot->cmd.iovec + iov_cnt);
+
+	return slot;
+}
+
+/* May be called from any thread */
+static void free_cmd_slot(struct tcmu_device *dev, struct tcmu_cmd_slot *slot)
+{
+	struct tcmu_cmd_slot *head;
+
+	if (!slot->pooled) {
+		free(slot);
+		return;
+	}
+
+	head = __atomic_load_n(&dev->returned_slots, __ATOMIC_RELAXED);
+	do {
+		slot->next = head;
+	} while (!__atomic_compare_exchange_n(&dev->returned_slots, &head, slot,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static struct tcmulib_cmd *
+ring_entry_to_cmd(struct tcmu_device *dev, struct tcmu_cmd_entry *ent)
 {
 	struct tcmu_mailbox *mb = dev->map;
+	struct tcmu_cmd_slot *slot;
+	struct tcmulib_cmd *cmd;
+	uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
+	unsigned cdb_len = tcmu_get_cdb_length(cdb);
+	struct iovec *iov;
+	int i;
 
-	return (struct tcmu_cmd_entry *) ((char *) mb + mb->cmdr_off + dev->cmd_tail);
+	/* Get storage for cmd itself, iovec and cdb */
+	slot = alloc_cmd_slot(dev, ent->req.iov_cnt, cdb_len);
+	if (!slot)
+		return NULL;
+	slot->inflight = true;
+	cmd = &slot->cmd;
+	cmd->cmd_id = ent->hdr.cmd_id;
+
+	/*
+	 * Convert iovec addrs to not be offsets, merging segments that
+	 * are adjacent in the data area; the kernel often hands out
+	 * consecutive pages.
+	 */
+	iov = cmd->iovec;
+	for (i = 0; i < ent->req.iov_cnt; i++) {
+		void *base = (void *) mb + (size_t) ent->req.iov[i].iov_base;
+		size_t len = ent->req.iov[i].iov_len;
+
+		if (iov != cmd->iovec && iov[-1].iov_base + iov[-1].iov_len == base) {
+			iov[-1].iov_len += len;
+			continue;
+		}
+
+		iov->iov_base = base;
+		iov->iov_len = len;
+		iov++;
+	}
+	cmd->iov_cnt = iov - cmd->iovec;
+
+	/* Copy cdb that currently points to the command ring */
+	memcpy(cmd->cdb, cdb, cdb_len);
+
+	tcmu_decode_cmd(cmd);
+
+	return cmd;
 }
 
-struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev)
+/* Record a command as it's taken off the ring, so it shows until done */
+static void trace_dequeue(struct tcmu_device *dev, struct tcmu_cmd_slot *slot)
+{
+	struct tcmulib_cmd *cmd = &slot->cmd;
+	struct tcmu_trace_ent *ent;
+	uint64_t pos;
+
+	pos = __atomic_fetch_add(&dev->trace_head, 1, __ATOMIC_RELAXED);
+	ent = &dev->trace[pos & dev->trace_mask];
+
+	/* Readers must see the entry as torn before any of it changes */
+	__atomic_store_n(&ent->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ent->done_seq = 0;
+	ent->rec.dequeue_ns = slot->dequeue_ns;
+	ent->rec.complete_ns = 0;
+	ent->rec.lba = cmd->lba;
+	ent->rec.xfer_len = cmd->xfer_len;
+	ent->rec.cmd_id = cmd->cmd_id;
+	ent->rec.opcode = cmd->opcode;
+	ent->rec.status = 0;
+
+	__atomic_store_n(&ent->seq, pos + 1, __ATOMIC_RELEASE);
+	slot->trace_seq = pos + 1;
+}
+
+/*
+ * Fill in a command's completion, unless its entry has been reused
+ * since. A dequeue reusing it at the same time may leave it looking
+ * unfinished, never torn: readers only trust the completion if
+ * done_seq matches seq.
+ */
+static void trace_complete(struct tcmu_device *dev, struct tcmu_cmd_slot *slot,
+			   uint64_t now)
+{
+	uint64_t seq = slot->trace_seq;
+	struct tcmu_trace_ent *ent;
+
+	ent = &dev->trace[(seq - 1) & dev->trace_mask];
+	if (__atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE) != seq)
+		return;
+
+	ent->rec.complete_ns = now;
+	ent->rec.status = slot->result == TCMU_NOT_HANDLED ? 0xff : slot->result;
+	__atomic_store_n(&ent->done_seq, seq, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int hist_bucket(uint32_t val)
+{
+	unsigned int bucket = val ? 32 - __builtin_clz(val) : 0;
+
+	return bucket < TCMULIB_HIST_BUCKETS ? bucket : TCMULIB_HIST_BUCKETS - 1;
+}
+
+/* cmd_head and cmd_tail as the kernel sees them */
+static void sample_ring(struct tcmu_device *dev, struct tcmu_ring_hist *hist,
+			uint32_t cmd_head, uint32_t cmd_tail)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	uint32_t fill = (cmd_head - cmd_tail + mb->cmdr_size) % mb->cmdr_size;
+	uint32_t inflight = __atomic_load_n(&dev->inflight, __ATOMIC_RELAXED);
+
+	hist->fill[(uint64_t) fill * TCMULIB_HIST_BUCKETS / mb->cmdr_size]++;
+	hist->inflight[hist_bucket(inflight)]++;
+	if (fill > hist->max_fill)
+		hist->max_fill = fill;
+	if (inflight > hist->max_inflight)
+		hist->max_inflight = inflight;
+}
+
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max)
 {
 	struct tcmu_mailbox *mb = dev->map;
 	struct tcmu_cmd_entry *ent;
+	uint32_t cmd_head;
+	uint64_t now = 0;
+	int count = 0;
 
-	while ((ent = device_cmd_tail(dev)) != device_cmd_head(dev)) {
+	/* Everything the kernel queued up to this point can be taken in one go */
+	cmd_head = mb->cmd_head;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	while (count < max && dev->cmd_tail != cmd_head) {
+		ent = device_cmd_tail(dev);
 
 		switch (tcmu_hdr_get_op(ent->hdr.len_op)) {
 		case TCMU_OP_PAD:
 			/* do nothing */
 			break;
-		case TCMU_OP_CMD: {
-			int i;
-			struct tcmulib_cmd *cmd;
-			uint8_t *cdb = (uint8_t *) mb + ent->req.cdb_off;
-			unsigned cdb_len = tcmu_get_cdb_length(cdb);
-
-			/* Alloc memory for cmd itself, iovec and cdb */
-			cmd = malloc(sizeof(*cmd) + sizeof(*cmd->iovec) * ent->req.iov_cnt + cdb_len);
-			if (!cmd)
-				return NULL;
-			cmd->cmd_id = ent->hdr.cmd_id;
-
-			/* Convert iovec addrs in-place to not be offsets */
-			cmd->iov_cnt = ent->req.iov_cnt;
-			cmd->iovec = (struct iovec *) (cmd + 1);
-			for (i = 0; i < ent->req.iov_cnt; i++) {
-				cmd->iovec[i].iov_base = (void *) mb +
-					(size_t) ent->req.iov[i].iov_base;
-				cmd->iovec[i].iov_len = ent->req.iov[i].iov_len;
+		case TCMU_OP_CMD:
+			cmds[count] = ring_entry_to_cmd(dev, ent);
+			/* Leave it on the ring for next time */
+			if (!cmds[count]) {
+				if (!count)
+					return -ENOMEM;
+				goto out;
 			}
-
-			/* Copy cdb that currently points to the command ring */
-			cmd->cdb = (uint8_t *) (cmd->iovec + cmd->iov_cnt);
-			memcpy(cmd->cdb, (void *) mb + ent->req.cdb_off, cdb_len);
-
-			dev->cmd_tail = (dev->cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
-			return cmd;
-		}
+			/* One clock read per burst is close enough */
+			if (!now)
+				now = now_ns();
+			((struct tcmu_cmd_slot *) cmds[count])->dequeue_ns = now;
+			if (dev->trace)
+				trace_dequeue(dev, (struct tcmu_cmd_slot *) cmds[count]);
+			else
+				((struct tcmu_cmd_slot *) cmds[count])->trace_seq = 0;
+			TCMU_PROBE5(cmd_dequeue, dev, cmds[count]->cmd_id,
+				    cmds[count]->opcode, cmds[count]->lba,
+				    cmds[count]->xfer_len);
+			count++;
+			break;
 		default:
 			/* We don't even know how to handle this TCMU opcode. */
 			ent->hdr.uflags |= TCMU_UFLAG_UNKNOWN_OP;
 		}
 
-		dev->cmd_tail = (dev->cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
+		/* Release: the entry must be fully read before it can be reused */
+		__atomic_store_n(&dev->cmd_tail,
+				 (dev->cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size,
+				 __ATOMIC_RELEASE);
 	}
 
-	return NULL;
+out:
+	__atomic_add_fetch(&dev->inflight, count, __ATOMIC_RELAXED);
+
+	if (count) {
+		sample_ring(dev, &dev->dequeue_hist, cmd_head, mb->cmd_tail);
+		dev->dequeue_hist.burst[hist_bucket(count)]++;
+	}
+
+	return count;
 }
 
-void tcmulib_command_complete(
-	struct tcmu_device *dev,
-	struct tcmulib_cmd *cmd,
-	int result)
+bool tcmulib_has_next_command(struct tcmu_device *dev)
 {
 	struct tcmu_mailbox *mb = dev->map;
-	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+
+	return __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE) != dev->cmd_tail;
+}
+
+struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev)
+{
+	struct tcmulib_cmd *cmd;
+
+	if (tcmulib_get_next_commands(dev, &cmd, 1) != 1)
+		return NULL;
+
+	return cmd;
+}
+
+/*
+ * Write the response for a completed command into the next command
+ * entry at or after cmd_tail, and return the new tail.
+ *
+ * The kernel looks commands up by the cmd_id it finds in the entry at
+ * its tail, and we only ever write entries that were already dequeued,
+ * so completing into whichever entry comes next lets commands finish
+ * in any order.
+ */
+static uint32_t complete_entry(struct tcmu_device *dev, uint32_t cmd_tail,
+			       struct tcmu_cmd_slot *slot)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	struct tcmu_cmd_entry *ent = (void *) mb + mb->cmdr_off + cmd_tail;
+	struct tcmulib_cmd *cmd = &slot->cmd;
+	uint32_t dequeued = __atomic_load_n(&dev->cmd_tail, __ATOMIC_ACQUIRE);
 
 	/* current command could be PAD in async case */
-	while (ent != (void *) mb + mb->cmdr_off + mb->cmd_head) {
+	while (cmd_tail != dequeued) {
 		if (tcmu_hdr_get_op(ent->hdr.len_op) == TCMU_OP_CMD)
 			break;
-		mb->cmd_tail = (mb->cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
-		ent = (void *) mb + mb->cmdr_off + mb->cmd_tail;
+		cmd_tail = (cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
+		ent = (void *) mb + mb->cmdr_off + cmd_tail;
 	}
 
 	/* cmd_id could be different in async case */
@@ -590,7 +1223,7 @@ void tcmulib_command_complete(
 		ent->hdr.cmd_id = cmd->cmd_id;
 	}
 
-	if (result == TCMU_NOT_HANDLED) {
+	if (slot->result == TCMU_NOT_HANDLED) {
 		/* Tell the kernel we didn't handle it */
 		char *buf = ent->rsp.sense_buffer;
 
@@ -602,15 +1235,199 @@ void tcmulib_command_complete(
 		buf[12] = 0x20; /* ASC: invalid command operation code */
 		buf[13] = 0x0;  /* ASCQ: (none) */
 	} else {
-		if (result != SAM_STAT_GOOD) {
+		if (slot->result != SAM_STAT_GOOD) {
 			memcpy(ent->rsp.sense_buffer, cmd->sense_buf,
 			       TCMU_SENSE_BUFFERSIZE);
 		}
-		ent->rsp.scsi_status = result;
+		ent->rsp.scsi_status = slot->result;
+	}
+
+	return (cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
+}
+
+/*
+ * Write all queued completions back to the ring. Only one thread does
+ * this at a time; if another thread already is, it will also pick up
+ * whatever we queued, so just return. Returns how many were retired.
+ */
+static int retire_completions(struct tcmu_device *dev)
+{
+	struct tcmu_mailbox *mb = dev->map;
+	struct tcmu_cmd_slot *list, *slot, *next, *oldest;
+	uint32_t cmd_tail;
+	int retired = 0;
+	int count;
+
+	while (!__atomic_exchange_n(&dev->retiring, 1, __ATOMIC_ACQUIRE)) {
+		while ((list = __atomic_exchange_n(&dev->completed, NULL,
+						   __ATOMIC_ACQUIRE))) {
+			/* Pushed LIFO, retire oldest first */
+			oldest = NULL;
+			for (slot = list; slot; slot = next) {
+				next = slot->next;
+				slot->next = oldest;
+				oldest = slot;
+			}
+
+			count = 0;
+			cmd_tail = mb->cmd_tail;
+			for (slot = oldest; slot; slot = next) {
+				next = slot->next;
+				cmd_tail = complete_entry(dev, cmd_tail, slot);
+				free_cmd_slot(dev, slot);
+				count++;
+			}
+
+			/* Responses must be visible before the kernel sees the new tail */
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			mb->cmd_tail = cmd_tail;
+
+			__atomic_sub_fetch(&dev->inflight, count, __ATOMIC_RELAXED);
+			retired += count;
+
+			sample_ring(dev, &dev->complete_hist, mb->cmd_head, cmd_tail);
+		}
+
+		__atomic_store_n(&dev->retiring, 0, __ATOMIC_SEQ_CST);
+
+		/*
+		 * Someone may have pushed after our last look and then
+		 * found us still holding 'retiring'. Go again for them.
+		 */
+		if (!__atomic_load_n(&dev->completed, __ATOMIC_SEQ_CST))
+			break;
 	}
 
-	mb->cmd_tail = (mb->cmd_tail + tcmu_hdr_get_len(ent->hdr.len_op)) % mb->cmdr_size;
-	free(cmd);
+	return retired;
+}
+
+static void push_completions(struct tcmu_device *dev,
+			     struct tcmu_cmd_slot *first,
+			     struct tcmu_cmd_slot *last)
+{
+	struct tcmu_cmd_slot *head;
+
+	head = __atomic_load_n(&dev->completed, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&dev->completed, &head, first,
+					      true, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+}
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+	unsigned int msb, bucket;
+
+	if (ns < (1 << TCMULIB_LAT_SUB_BITS))
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	bucket = ((msb - TCMULIB_LAT_SUB_BITS + 1) << TCMULIB_LAT_SUB_BITS) |
+		((ns >> (msb - TCMULIB_LAT_SUB_BITS)) & ((1 << TCMULIB_LAT_SUB_BITS) - 1));
+
+	return bucket < TCMULIB_LAT_BUCKETS ? bucket : TCMULIB_LAT_BUCKETS - 1;
+}
+
+/* The longest latency bucket counts */
+static uint64_t lat_bucket_max(unsigned int bucket)
+{
+	unsigned int shift = bucket >> TCMULIB_LAT_SUB_BITS;
+	uint64_t sub = bucket & ((1 << TCMULIB_LAT_SUB_BITS) - 1);
+
+	if (!shift)
+		return sub;
+
+	return ((((1ULL << TCMULIB_LAT_SUB_BITS) | sub) + 1) << (shift - 1)) - 1;
+}
+
+static void count_completion(struct tcmu_device *dev,
+			     struct tcmu_cmd_slot *slot, uint64_t now)
+{
+	struct tcmulib_cmd *cmd = &slot->cmd;
+	struct tcmulib_lat_hist *hist;
+	uint64_t lat, max;
+
+	if (slot->result == SAM_STAT_GOOD) {
+		if (cmd->cmd_class == TCMULIB_CMD_READ)
+			__atomic_add_fetch(&dev->bytes_read, cmd->data_len, __ATOMIC_RELAXED);
+		else if (cmd->cmd_class == TCMULIB_CMD_WRITE)
+			__atomic_add_fetch(&dev->bytes_written, cmd->data_len, __ATOMIC_RELAXED);
+	} else if (slot->result == SAM_STAT_CHECK_CONDITION) {
+		__atomic_add_fetch(&dev->check_condition, 1, __ATOMIC_RELAXED);
+	} else if (slot->result == TCMU_NOT_HANDLED) {
+		__atomic_add_fetch(&dev->not_handled, 1, __ATOMIC_RELAXED);
+	}
+
+	if (cmd->cmd_class >= TCMULIB_CMD_CLASSES)
+		return;
+	hist = &dev->lat_hist[cmd->cmd_class];
+	lat = now > slot->dequeue_ns ? now - slot->dequeue_ns : 0;
+
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum_ns, lat, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->buckets[lat_bucket(lat)], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+	while (lat > max &&
+	       !__atomic_compare_exchange_n(&hist->max_ns, &max, lat, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static bool mark_completed(struct tcmu_device *dev, struct tcmu_cmd_slot *slot,
+			   int result, uint64_t now)
+{
+	if (!__atomic_exchange_n(&slot->inflight, false, __ATOMIC_RELAXED)) {
+		tcmu_errp(dev->ctx, "%s: cmd %u completed twice\n",
+			  dev->dev_name, slot->cmd.cmd_id);
+		return false;
+	}
+
+	slot->result = result;
+	count_completion(dev, slot, now);
+	TCMU_PROBE5(cmd_complete, dev, slot->cmd.cmd_id, slot->cmd.opcode,
+		    result, now - slot->dequeue_ns);
+	if (slot->trace_seq)
+		trace_complete(dev, slot, now);
+	return true;
+}
+
+void tcmulib_commands_complete(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd **cmds,
+	int *results,
+	int count)
+{
+	struct tcmu_cmd_slot *first = NULL, *last = NULL, *slot;
+	uint64_t now = now_ns();
+	int i;
+
+	/* Chain them up so the whole batch goes in with one push */
+	for (i = 0; i < count; i++) {
+		slot = (struct tcmu_cmd_slot *) cmds[i];
+		if (!mark_completed(dev, slot, results[i], now))
+			continue;
+
+		slot->next = first;
+		first = slot;
+		if (!last)
+			last = slot;
+	}
+
+	if (first)
+		push_completions(dev, first, last);
+}
+
+void tcmulib_command_complete(
+	struct tcmu_device *dev,
+	struct tcmulib_cmd *cmd,
+	int result)
+{
+	struct tcmu_cmd_slot *slot = (struct tcmu_cmd_slot *) cmd;
+
+	if (mark_completed(dev, slot, result, now_ns()))
+		push_completions(dev, slot, slot);
 }
 
 void tcmulib_processing_start(struct tcmu_device *dev)
@@ -626,11 +1443,16 @@ void tcmulib_processing_start(struct tcmu_device *dev)
 		perror("read");
 }
 
-void tcmulib_processing_complete(struct tcmu_device *dev)
+static void notify_kernel(struct tcmu_device *dev)
 {
 	int r;
 	uint32_t buf = 0;
 
+	if (dev->notify_hook) {
+		dev->notify_hook(dev, dev->notify_hook_data);
+		return;
+	}
+
 	/* Tell the kernel there are completed commands */
 	do {
 		r = write(dev->fd, &buf, 4);
@@ -638,3 +1460,298 @@ void tcmulib_processing_complete(struct tcmu_device *dev)
 	if (r == -1 && errno != EAGAIN)
 		perror("write");
 }
+
+static bool ring_empty(struct tcmu_device *dev)
+{
+	struct tcmu_mailbox *mb = dev->map;
+
+	return mb->cmd_head == __atomic_load_n(&dev->cmd_tail, __ATOMIC_RELAXED);
+}
+
+void tcmulib_processing_complete(struct tcmu_device *dev)
+{
+	unsigned int retired;
+	unsigned int pending;
+	uint64_t now;
+
+	retired = retire_completions(dev);
+
+	if (!dev->notify_batch) {
+		notify_kernel(dev);
+		return;
+	}
+
+	now = now_ns();
+	if (!retired) {
+		pending = __atomic_load_n(&dev->unnotified, __ATOMIC_RELAXED);
+		if (!pending)
+			return;
+	} else {
+		pending = __atomic_add_fetch(&dev->unnotified, retired, __ATOMIC_RELAXED);
+		if (pending == retired)
+			__atomic_store_n(&dev->unnotified_since, now, __ATOMIC_RELAXED);
+	}
+
+	/*
+	 * Hold the notification back only while more completions are
+	 * bound to follow soon: commands are still outstanding or more
+	 * are waiting on the ring. Otherwise nothing would come along
+	 * to batch with, so don't add latency.
+	 */
+	if (pending < dev->notify_batch &&
+	    now - __atomic_load_n(&dev->unnotified_since, __ATOMIC_RELAXED) <
+	    dev->notify_delay_us * 1000ULL &&
+	    (__atomic_load_n(&dev->inflight, __ATOMIC_RELAXED) || !ring_empty(dev)))
+		return;
+
+	if (__atomic_exchange_n(&dev->unnotified, 0, __ATOMIC_RELAXED))
+		notify_kernel(dev);
+}
+
+int tcmulib_handover_device(struct tcmu_device *dev,
+			    struct tcmulib_handover *h)
+{
+	struct tcmulib_context *ctx = dev->ctx;
+	struct tcmu_mailbox *mb = dev->map;
+	struct tcmu_cmd_slot *slot;
+	unsigned int stuck = 0;
+	unsigned int i;
+	int fd;
+
+	if (dev_is_sim(dev))
+		return -EINVAL;
+
+	memset(h, 0, sizeof(*h));
+	snprintf(h->dev_name, sizeof(h->dev_name), "%s", dev->dev_name);
+	/* tcm_hba_name is "user_" and the HBA's number */
+	if (snprintf(h->uio_name, sizeof(h->uio_name), "tcm-user/%s/%s/%s",
+		     dev->tcm_hba_name + 5, dev->tcm_dev_name,
+		     dev->cfgstring) >= sizeof(h->uio_name))
+		return -ENAMETOOLONG;
+
+	fd = fcntl(dev->fd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	tcmu_loop_del_device(dev);
+	unregister_device(ctx, dev);
+
+	dev->handler->removed(dev);
+
+	/*
+	 * Whatever the handler didn't finish is failed with BUSY, for
+	 * the initiator to retry, so the ring is left with nothing
+	 * taken and not completed.
+	 */
+	for (i = 0; i < dev->slots_used; i++) {
+		slot = &dev->slots[i];
+		if (!__atomic_load_n(&slot->inflight, __ATOMIC_RELAXED))
+			continue;
+		if (mark_completed(dev, slot, SAM_STAT_BUSY, now_ns())) {
+			push_completions(dev, slot, slot);
+			stuck++;
+		}
+	}
+	if (stuck)
+		tcmu_errp(ctx, "%s: %u commands still in flight, failed them with BUSY\n",
+			  dev->dev_name, stuck);
+
+	/* Whatever was held back or queued for a hook, the kernel hears of it now */
+	retire_completions(dev);
+	dev->notify_hook = NULL;
+	notify_kernel(dev);
+
+	h->cmd_tail = mb->cmd_tail;
+	h->fd = fd;
+
+	close_device(dev);
+	return 0;
+}
+
+void tcmulib_set_notify_coalescing(struct tcmu_device *dev,
+				   unsigned int max_batch,
+				   unsigned int max_delay_us)
+{
+	bool on = max_batch > 1;
+
+	dev->notify_delay_us = max_delay_us;
+	dev->notify_batch = on ? max_batch : 0;
+
+	/* Let the built-in loop know it has deadlines to keep */
+	tcmu_loop_coalescing(dev, on);
+}
+
+void tcmulib_get_ring_stats(struct tcmu_device *dev,
+			    struct tcmulib_ring_stats *stats)
+{
+	struct tcmu_ring_hist *dq = &dev->dequeue_hist;
+	struct tcmu_ring_hist *cq = &dev->complete_hist;
+	struct tcmu_mailbox *mb = dev->map;
+	int i;
+
+	stats->ring_size = mb->cmdr_size;
+	stats->max_fill = dq->max_fill > cq->max_fill ? dq->max_fill : cq->max_fill;
+	stats->max_inflight = dq->max_inflight > cq->max_inflight ?
+		dq->max_inflight : cq->max_inflight;
+
+	for (i = 0; i < TCMULIB_HIST_BUCKETS; i++) {
+		stats->fill[i] = dq->fill[i] + cq->fill[i];
+		stats->inflight[i] = dq->inflight[i] + cq->inflight[i];
+		stats->burst[i] = dq->burst[i];
+	}
+}
+
+void tcmulib_reset_ring_stats(struct tcmu_device *dev)
+{
+	memset(&dev->dequeue_hist, 0, sizeof(dev->dequeue_hist));
+	memset(&dev->complete_hist, 0, sizeof(dev->complete_hist));
+}
+
+void tcmulib_get_latency_stats(struct tcmu_device *dev, int cmd_class,
+			       struct tcmulib_lat_hist *hist)
+{
+	struct tcmulib_lat_hist *src = &dev->lat_hist[cmd_class];
+	int i;
+
+	hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	hist->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+	hist->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+	for (i = 0; i < TCMULIB_LAT_BUCKETS; i++)
+		hist->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+void tcmulib_get_cmd_stats(struct tcmu_device *dev,
+			   struct tcmulib_cmd_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < TCMULIB_CMD_CLASSES; i++)
+		stats->cmds[i] = __atomic_load_n(&dev->lat_hist[i].count, __ATOMIC_RELAXED);
+	stats->bytes_read = __atomic_load_n(&dev->bytes_read, __ATOMIC_RELAXED);
+	stats->bytes_written = __atomic_load_n(&dev->bytes_written, __ATOMIC_RELAXED);
+	stats->not_handled = __atomic_load_n(&dev->not_handled, __ATOMIC_RELAXED);
+	stats->check_condition = __atomic_load_n(&dev->check_condition, __ATOMIC_RELAXED);
+	stats->inflight = __atomic_load_n(&dev->inflight, __ATOMIC_RELAXED);
+}
+
+void tcmulib_reset_latency_stats(struct tcmu_device *dev)
+{
+	memset(dev->lat_hist, 0, sizeof(dev->lat_hist));
+}
+
+uint64_t tcmulib_lat_percentile(const struct tcmulib_lat_hist *hist,
+				double pct)
+{
+	uint64_t total = 0, seen = 0;
+	int i;
+
+	/* Sum the buckets, count may have moved on since they were read */
+	for (i = 0; i < TCMULIB_LAT_BUCKETS; i++)
+		total += hist->buckets[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < TCMULIB_LAT_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen * 100.0 >= total * pct)
+			break;
+	}
+
+	/* Nothing took longer than the max, whatever its bucket says */
+	if (i == TCMULIB_LAT_BUCKETS || lat_bucket_max(i) > hist->max_ns)
+		return hist->max_ns;
+	return lat_bucket_max(i);
+}
+
+int tcmulib_set_trace_size(struct tcmu_device *dev, unsigned int nr_recs)
+{
+	struct tcmu_trace_ent *trace = NULL;
+	unsigned int size = 1;
+
+	if (nr_recs) {
+		while (size < nr_recs)
+			size <<= 1;
+
+		trace = calloc(size, sizeof(*trace));
+		if (!trace)
+			return -ENOMEM;
+	}
+
+	free(dev->trace);
+	dev->trace = trace;
+	dev->trace_mask = size - 1;
+	dev->trace_head = 0;
+	return 0;
+}
+
+int tcmulib_get_trace(struct tcmu_device *dev,
+		      struct tcmulib_trace_rec *recs, int max)
+{
+	struct tcmu_trace_ent *ent;
+	struct tcmulib_trace_rec rec;
+	uint64_t head, pos, seq, done_seq;
+	int count = 0;
+
+	if (!dev->trace || max <= 0)
+		return 0;
+
+	head = __atomic_load_n(&dev->trace_head, __ATOMIC_ACQUIRE);
+	pos = head > dev->trace_mask + 1 ? head - (dev->trace_mask + 1) : 0;
+	if (head - pos > max)
+		pos = head - max;
+
+	for (; pos < head; pos++) {
+		ent = &dev->trace[pos & dev->trace_mask];
+
+		seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+		if (seq != pos + 1)
+			continue; /* still being written, or already reused */
+
+		done_seq = __atomic_load_n(&ent->done_seq, __ATOMIC_ACQUIRE);
+		rec = ent->rec;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		/* Still in flight, whatever half-written completion it has */
+		if (done_seq != seq) {
+			rec.complete_ns = 0;
+			rec.status = 0;
+		}
+
+		recs[count++] = rec;
+	}
+
+	return count;
+}
+
+void tcmulib_set_notify_hook(struct tcmu_device *dev,
+			     void (*hook)(struct tcmu_device *dev, void *data),
+			     void *data)
+{
+	dev->notify_hook_data = data;
+	dev->notify_hook = hook;
+}
+
+int tcmulib_get_notify_timeout(struct tcmu_device *dev)
+{
+	uint64_t waited;
+
+	if (!dev->notify_batch)
+		return -1;
+
+	if (!__atomic_load_n(&dev->unnotified, __ATOMIC_RELAXED)) {
+		/* Completions may still come in from other threads */
+		if (__atomic_load_n(&dev->inflight, __ATOMIC_RELAXED))
+			return dev->notify_delay_us;
+		return -1;
+	}
+
+	waited = (now_ns() - __atomic_load_n(&dev->unnotified_since,
+					     __ATOMIC_RELAXED)) / 1000;
+	if (waited >= dev->notify_delay_us)
+		return 0;
+
+	return dev->notify_delay_us - waited;
+}
@@ -59,6 +59,14 @@ struct tcmulib_handler {
 	void (*removed)(struct tcmu_device *dev);
 
 	void *hm_private; /* private ptr for handler module */
+
+	/*
+	 * Set if added() may be called for several devices at once,
+	 * from threads other than the main one. Devices that already
+	 * exist when tcmulib_initialize() is called are then opened in
+	 * parallel. Kept last so the fields before it stay put.
+	 */
+	bool parallel_added;
 };
 
 /*
@@ -90,6 +98,22 @@ int tcmulib_get_master_fd(struct tcmulib_context *ctx);
  */
 int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
 
+/*
+ * Find a device by its uio minor (the 14 of /dev/uio14), or NULL.
+ * Takes constant time and may be called from any thread, but the
+ * device must not be used past its removed() callback.
+ */
+struct tcmu_device *tcmulib_lookup_dev(struct tcmulib_context *ctx,
+				       unsigned int minor);
+
+/*
+ * A private pointer for the libtcmu user, apart from the handler's
+ * tcmu_get_dev_private(), for when the two aren't the same code (as
+ * with tcmu-runner and its handler modules).
+ */
+void *tcmulib_get_dev_data(struct tcmu_device *dev);
+void tcmulib_set_dev_data(struct tcmu_device *dev, void *data);
+
 /*
  * When a device fd becomes ready, call this to get SCSI cmd info in
  * 'cmd' struct.
@@ -98,19 +122,298 @@ int tcmulib_master_fd_ready(struct tcmulib_context *ctx);
 struct tcmulib_cmd *tcmulib_get_next_command(struct tcmu_device *dev);
 
 /*
- * Mark the command as complete.
- * Must be called before get_next_command() is called again.
+ * Cheap check for whether the kernel has queued commands we haven't
+ * taken yet, e.g. for spinning on the ring instead of sleeping on the
+ * device fd. Doesn't touch the fd.
+ */
+bool tcmulib_has_next_command(struct tcmu_device *dev);
+
+/*
+ * Burst version of tcmulib_get_next_command(). Fills cmds with up to
+ * max commands that were queued when it was called and returns how
+ * many it got; 0 means the ring is empty. -ENOMEM if there was no
+ * memory for the first one: the ring still has commands, which the
+ * caller has to come back for without waiting on the device fd.
+ */
+int tcmulib_get_next_commands(struct tcmu_device *dev,
+			      struct tcmulib_cmd **cmds, int max);
+
+/*
+ * Mark the command as complete. Commands may be completed in any
+ * order, and from any thread, including concurrently.
  *
- * result is scsi status, or TCMU_NOT_HANDLED or TCMU_ASYNC_HANDLED.
+ * result is scsi status, or TCMU_NOT_HANDLED.
+ *
+ * The completion is queued; it reaches the ring on the next
+ * tcmulib_processing_complete() call for the device.
  */
 void tcmulib_command_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd, int result);
 
-/* Call when start processing commands (before calling tcmulib_get_next_command()) */
+/* Complete count commands, cmds[i] with results[i], in one go */
+void tcmulib_commands_complete(struct tcmu_device *dev, struct tcmulib_cmd **cmds,
+			       int *results, int count);
+
+/*
+ * Call when start processing commands (before calling tcmulib_get_next_command()).
+ * All it does is read() the device fd to clear its event, so it can be
+ * skipped by callers that already consume the event some other way.
+ */
 void tcmulib_processing_start(struct tcmu_device *dev);
 
-/* Call when complete processing commands (tcmulib_get_next_command() returned NULL) */
+/*
+ * Call when complete processing commands (tcmulib_get_next_command()
+ * returned NULL), and after completing commands asynchronously. Writes
+ * queued completions back to the ring and tells the kernel. Safe to
+ * call from several threads at once.
+ */
 void tcmulib_processing_complete(struct tcmu_device *dev);
 
+/*
+ * Coalesce kernel notifications for a device: tcmulib_processing_complete()
+ * then only notifies once max_batch completions have accumulated, the
+ * oldest of them has waited max_delay_us, or nothing else is in flight
+ * or queued. max_batch of 0 or 1 turns this off, which is the default.
+ *
+ * Whoever services the device fd must then call
+ * tcmulib_processing_complete() again when tcmulib_get_notify_timeout()
+ * expires, even if the fd did not become ready.
+ */
+void tcmulib_set_notify_coalescing(struct tcmu_device *dev,
+				   unsigned int max_batch,
+				   unsigned int max_delay_us);
+
+/*
+ * Microseconds until deferred completions must be flushed with
+ * tcmulib_processing_complete(), or -1 if there's nothing to wait for.
+ */
+int tcmulib_get_notify_timeout(struct tcmu_device *dev);
+
+/*
+ * Have tcmulib_processing_complete() call hook(dev, data) instead of
+ * write()ing the device fd itself when the kernel is to be told about
+ * completions, e.g. to queue that write on an io_uring. The hook is
+ * called from whichever thread runs tcmulib_processing_complete().
+ * Pass a NULL hook to go back to write().
+ */
+void tcmulib_set_notify_hook(struct tcmu_device *dev,
+			     void (*hook)(struct tcmu_device *dev, void *data),
+			     void *data);
+
+/*
+ * Ring telemetry
+ *
+ * libtcmu samples each device's ring whenever it takes commands off
+ * it and whenever it writes completions back. fill is how much of
+ * the ring the kernel had in use, in sixteenths: fill[i] counts
+ * samples with i/16 to (i+1)/16 of it full. inflight (commands taken
+ * off the ring, not yet completed back to it) and burst (commands
+ * taken at once) are power-of-two histograms: [0] counts zeroes, and
+ * [i] counts values from 2^(i-1) to 2^i - 1, with the last bucket
+ * also counting everything bigger.
+ *
+ * Samples are taken without locking, so a snapshot read while the
+ * device is busy may be off by a few.
+ */
+struct tcmulib_ring_stats {
+	uint32_t ring_size;	/* bytes */
+	uint32_t max_fill;	/* bytes */
+	uint32_t max_inflight;
+	uint64_t fill[TCMULIB_HIST_BUCKETS];
+	uint64_t inflight[TCMULIB_HIST_BUCKETS];
+	uint64_t burst[TCMULIB_HIST_BUCKETS];
+};
+
+void tcmulib_get_ring_stats(struct tcmu_device *dev,
+			    struct tcmulib_ring_stats *stats);
+
+/*
+ * Start counting afresh. Only safe while nothing is dequeueing or
+ * completing commands for the device, otherwise some samples in
+ * flight may survive it.
+ */
+void tcmulib_reset_ring_stats(struct tcmu_device *dev);
+
+/*
+ * Command latency
+ *
+ * libtcmu times each command from when it's taken off the ring to
+ * when it's completed, whether inline or asynchronously, and counts
+ * it in one histogram per device and tcmulib_cmd_class. Buckets are
+ * log-linear, as in HdrHistogram: [i] for i < 16 counts i ns, and
+ * above that there are 16 buckets per power of two, so a bucket is
+ * within 1/16 of any latency it counts. The last bucket also counts
+ * everything longer.
+ *
+ * Counters are updated with relaxed atomics, so they can be read at
+ * any time, but a snapshot of a busy device may be off by a few.
+ */
+#define TCMULIB_LAT_SUB_BITS	4
+#define TCMULIB_LAT_BUCKETS	(48 << TCMULIB_LAT_SUB_BITS)
+
+struct tcmulib_lat_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[TCMULIB_LAT_BUCKETS];
+};
+
+/* cmd_class is an enum tcmulib_cmd_class */
+void tcmulib_get_latency_stats(struct tcmu_device *dev, int cmd_class,
+			       struct tcmulib_lat_hist *hist);
+
+/* Same caveat as tcmulib_reset_ring_stats() */
+void tcmulib_reset_latency_stats(struct tcmu_device *dev);
+
+/*
+ * Latency at or below which pct percent of the commands in hist
+ * completed, rounded up to the bucket's upper bound. 0 if it's empty.
+ */
+uint64_t tcmulib_lat_percentile(const struct tcmulib_lat_hist *hist,
+				double pct);
+
+/*
+ * Command counters, kept per device as commands complete. cmds counts
+ * commands of each tcmulib_cmd_class; it's the latency histograms'
+ * count, so tcmulib_reset_latency_stats() resets it too. The rest are
+ * never reset. Bytes
+ * are only counted for reads and writes that completed with GOOD
+ * status. inflight is how many commands were taken off the ring and
+ * not yet written back to it.
+ */
+struct tcmulib_cmd_stats {
+	uint64_t cmds[TCMULIB_CMD_CLASSES];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t not_handled;		/* completed with TCMU_NOT_HANDLED */
+	uint64_t check_condition;	/* completed with CHECK CONDITION */
+	uint32_t inflight;
+};
+
+/* Lock-free, may be called from any thread while commands flow */
+void tcmulib_get_cmd_stats(struct tcmu_device *dev,
+			   struct tcmulib_cmd_stats *stats);
+
+/*
+ * Command trace
+ *
+ * libtcmu records the opcode, LBA, length, status and timing of each
+ * device's most recent commands, in a fixed-size ring that's written
+ * without locks or syscalls beyond reading the clock, so it can be left
+ * on in production. A command is recorded as it's taken off the ring,
+ * so ones that are stuck show up too, and its status and completion
+ * time are filled in when it completes. It holds TCMULIB_TRACE_DEFAULT
+ * records unless tcmulib_set_trace_size() says otherwise.
+ */
+#define TCMULIB_TRACE_DEFAULT 1024
+
+struct tcmulib_trace_rec {
+	uint64_t dequeue_ns;	/* CLOCK_MONOTONIC, when taken off the ring */
+	uint64_t complete_ns;	/* when the command was completed, 0 if not yet */
+	uint64_t lba;
+	uint32_t xfer_len;
+	uint16_t cmd_id;
+	uint8_t opcode;
+	uint8_t status;		/* SCSI status, 0xff for TCMU_NOT_HANDLED */
+};
+
+/*
+ * Keep the last nr_recs records, rounded up to a power of two, or
+ * turn the trace off with 0. Only call this before the device's
+ * commands are handled, e.g. from the handler's added() callback.
+ * Returns 0 or -ENOMEM.
+ */
+int tcmulib_set_trace_size(struct tcmu_device *dev, unsigned int nr_recs);
+
+/*
+ * Copy out up to max of the most recent records, oldest first, and
+ * return how many were copied. May be called from any thread while
+ * commands flow; records overwritten during the copy are left out.
+ */
+int tcmulib_get_trace(struct tcmu_device *dev,
+		      struct tcmulib_trace_rec *recs, int max);
+
+/*
+ * Built-in event loop
+ *
+ * Instead of servicing the master fd and device fds from your own
+ * loop, call tcmulib_run() from your main thread. It waits on all of
+ * them with epoll, calls tcmulib_master_fd_ready() as needed, and
+ * calls dev_ready() for each device whose fd became ready. dev_ready()
+ * should do the tcmulib_processing_start(), tcmulib_get_next_command()
+ * ..., tcmulib_processing_complete() cycle. Devices are added to the
+ * loop when it first runs, and then as they come and go. Notifications held back
+ * by tcmulib_set_notify_coalescing() are flushed on time, to the
+ * millisecond.
+ *
+ * Returns 0 once tcmulib_stop() was called, or -errno if epoll fails.
+ */
+int tcmulib_run(struct tcmulib_context *ctx,
+		void (*dev_ready)(struct tcmu_device *dev));
+
+/* Make tcmulib_run() return. May be called from any thread. */
+void tcmulib_stop(struct tcmulib_context *ctx);
+
+/*
+ * Have tcmulib_run() call cb(fd, data) whenever fd is readable, e.g.
+ * an eventfd signalled when asynchronous commands complete. Only call
+ * these from the thread running tcmulib_run(), or before it runs.
+ */
+int tcmulib_add_fd(struct tcmulib_context *ctx, int fd,
+		   void (*cb)(int fd, void *data), void *data);
+int tcmulib_del_fd(struct tcmulib_context *ctx, int fd);
+
+/*
+ * Handing devices over to another process
+ *
+ * The kernel only lets one process open a device's uio fd, and fails
+ * the commands of a device whose fd gets closed, so a new process
+ * can't take a device over by opening it. Instead the new one claims
+ * each device from the old one as it comes to open it, see
+ * tcmulib_initialize_handover(). The old one then stops taking that
+ * device's commands, lets those it took complete,
+ * tcmulib_handover_device()s it and passes the fd on, e.g. with
+ * SCM_RIGHTS, while its other devices carry on. The new one picks the
+ * device up where the old one left off.
+ */
+struct tcmulib_handover {
+	char dev_name[16];	/* e.g. "uio14" */
+	char uio_name[512];	/* the uio device's name, "tcm-user/..." */
+	uint32_t cmd_tail;	/* ring offset to take commands from */
+	int fd;			/* the uio fd */
+};
+
+/*
+ * Stop serving dev and fill in h with what another process needs to
+ * carry on with it. Calls the handler's removed(), which must stop
+ * taking commands off the ring and wait for those already taken to
+ * be completed. h->fd is a new fd for the caller to pass on and
+ * close. Returns 0 or -errno, in which case dev is left as it was.
+ */
+int tcmulib_handover_device(struct tcmu_device *dev,
+			    struct tcmulib_handover *h);
+
+/*
+ * Get a device from the process serving it, filling in h. Returns 0,
+ * 1 if that process doesn't have it, or -errno. h->fd becomes
+ * libtcmu's, even if the device can't be added.
+ */
+typedef int (*tcmulib_claim_fn)(const char *dev_name,
+				struct tcmulib_handover *h, void *data);
+
+/*
+ * tcmulib_initialize(), claiming each device it finds from another
+ * process before opening it. Devices are claimed as they're opened,
+ * several at once if their handlers have parallel_added set, so
+ * claim may be called from several threads at once. Devices the other
+ * process doesn't have are opened as usual.
+ */
+struct tcmulib_context *tcmulib_initialize_handover(
+	struct tcmulib_handler *handlers,
+	size_t handler_count,
+	void (*err_print)(const char *fmt, ...),
+	tcmulib_claim_fn claim,
+	void *data);
+
 /* Clean up loose ends when exiting */
 void tcmulib_close(struct tcmulib_context *ctx);
 
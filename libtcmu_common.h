@@ -32,27 +32,63 @@ struct tcmu_device;
 
 #define SENSE_BUFFERSIZE 96
 
+/* Buckets in libtcmu's histograms */
+#define TCMULIB_HIST_BUCKETS 16
+
+/* Rough kind of command, as far as the data path cares */
+enum tcmulib_cmd_class {
+	TCMULIB_CMD_OTHER,
+	TCMULIB_CMD_READ,
+	TCMULIB_CMD_WRITE,	/* includes WRITE AND VERIFY */
+	TCMULIB_CMD_FLUSH,
+	TCMULIB_CMD_CLASSES,
+};
+
+/* tcmulib_cmd flags */
+#define TCMULIB_CMD_FUA		(1 << 0)
+#define TCMULIB_CMD_DPO		(1 << 1)
+#define TCMULIB_CMD_CONTIGUOUS	(1 << 2)	/* data is one buffer, iovec[0] */
+
 struct tcmulib_cmd {
 	uint16_t cmd_id;
 	uint8_t *cdb;
 	struct iovec *iovec;
 	size_t iov_cnt;
 	uint8_t sense_buf[SENSE_BUFFERSIZE];
+
+	/*
+	 * Decoded from the cdb when the command is dequeued, so handlers
+	 * don't each have to parse it again. lba and xfer_len follow the
+	 * usual CDB layout for the command's length and are only
+	 * meaningful for commands that have them; xfer_len is in blocks
+	 * for reads and writes.
+	 */
+	uint8_t opcode;
+	uint8_t cmd_class;	/* enum tcmulib_cmd_class */
+	uint8_t flags;
+	uint8_t cdb_len;
+	uint32_t xfer_len;
+	uint64_t lba;
+	size_t data_len;	/* total length of iovec */
 };
 
 /* Set/Get methods for the opaque tcmu_device */
 void *tcmu_get_dev_private(struct tcmu_device *dev);
 void tcmu_set_dev_private(struct tcmu_device *dev, void *priv);
 int tcmu_get_dev_fd(struct tcmu_device *dev);
+unsigned int tcmu_get_dev_minor(struct tcmu_device *dev);
 char *tcmu_get_dev_cfgstring(struct tcmu_device *dev);
 struct tcmulib_handler *tcmu_get_dev_handler(struct tcmu_device *dev);
 
 /* Helper routines for processing commands */
 int tcmu_get_attribute(struct tcmu_device *dev, const char *name);
 long long tcmu_get_device_size(struct tcmu_device *dev);
+int tcmu_refresh_attributes(struct tcmu_device *dev);
+void tcmu_invalidate_attributes(struct tcmu_device *dev);
 int tcmu_get_cdb_length(uint8_t *cdb);
 uint64_t tcmu_get_lba(uint8_t *cdb);
 uint32_t tcmu_get_xfer_length(uint8_t *cdb);
+void tcmu_decode_cmd(struct tcmulib_cmd *cmd);
 off_t tcmu_compare_with_iovec(void *mem, struct iovec *iovec, size_t size);
 void tcmu_seek_in_iovec(struct iovec *iovec, size_t count);
 size_t tcmu_memcpy_into_iovec(struct iovec *iovec, size_t iov_cnt, void *src, size_t len);
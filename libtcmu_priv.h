@@ -24,14 +24,48 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/uio.h>
 #include <gio/gio.h>
 
+#include "libtcmu.h"
+#include "libtcmu_common.h"
 #include "scsi_defs.h"
 #include "darray.h"
 
 #define KERN_IFACE_VER 2
 
+/*
+ * Commands whose iovec or CDB don't fit in a slot fall back to a
+ * malloc()ed descriptor.
+ */
+#define TCMU_CMD_SLOT_IOVS	16
+#define TCMU_CMD_SLOT_CDB_LEN	32
+
+/* Something the built-in event loop (libtcmu-loop.c) waits on */
+enum tcmu_loop_type {
+	TCMU_LOOP_MASTER,
+	TCMU_LOOP_WAKE,
+	TCMU_LOOP_DEVICE,
+	TCMU_LOOP_USER,
+};
+
+struct tcmu_loop_source {
+	int type;	/* enum tcmu_loop_type */
+	int fd;		/* -1 once a user fd was removed */
+	void (*cb)(int fd, void *data);
+	void *data;	/* the device for TCMU_LOOP_DEVICE */
+};
+
+/*
+ * Devices by uio minor, in chunks allocated as minors get used. uio
+ * allows up to 1 << MINORBITS of them.
+ */
+#define TCMU_MAX_MINORS		(1 << 20)
+#define TCMU_DEV_CHUNK_SHIFT	8
+#define TCMU_DEV_CHUNK		(1 << TCMU_DEV_CHUNK_SHIFT)
+#define TCMU_DEV_CHUNKS		(TCMU_MAX_MINORS / TCMU_DEV_CHUNK)
+
 // The full (private) declaration
 struct tcmulib_context {
 	darray(struct tcmulib_handler) handlers;
@@ -39,17 +73,110 @@ struct tcmulib_context {
 	/* Just keep ptrs b/c we hand these to clients */
 	darray(struct tcmu_device*) devices;
 
+	/*
+	 * Only the main thread adds and removes devices, but any thread
+	 * may look them up, see tcmulib_lookup_dev().
+	 */
+	struct tcmu_device **dev_chunks[TCMU_DEV_CHUNKS];
+
 	struct nl_sock *nl_sock;
 
 	void (*err_print)(const char *fmt, ...);
 
+	/* While opening the devices found on start, see tcmulib_initialize_handover() */
+	tcmulib_claim_fn claim;
+	void *claim_data;
+
 	unsigned reg_count_down;
 
 	GDBusConnection *connection;
+
+	/* Built-in event loop, see tcmulib_run() */
+	int epoll_fd;
+	struct tcmu_loop_source master_src;
+	struct tcmu_loop_source wake_src;
+	darray(struct tcmu_loop_source *) loop_sources; /* user fds */
+	darray(struct tcmu_loop_source *) loop_dead; /* freed after dispatch */
+	bool loop_stop;
+	bool loop_devices;	/* devices' fds are in epoll_fd, see tcmulib_run() */
+	/* Devices with notify coalescing on, which the loop must flush */
+	pthread_mutex_t coalescing_lock;
+	darray(struct tcmu_device *) coalescing;
 };
 
+/*
+ * For tcmu-sim, see libtcmu.c. Only built into the tcmu_sim test
+ * library, not libtcmu itself.
+ */
+#ifdef TCMU_SIM
+struct tcmulib_context *tcmu_sim_initialize(struct tcmulib_handler *handlers,
+					    size_t handler_count,
+					    void (*err_print)(const char *fmt, ...));
+void tcmu_sim_close(struct tcmulib_context *ctx);
+struct tcmu_device *tcmu_sim_add_device(struct tcmulib_context *ctx,
+					char *dev_name, char *cfgstring,
+					int fd, void *map, size_t map_len,
+					int block_size, long long size);
+void tcmu_sim_remove_device(struct tcmu_device *dev);
+
+#define dev_is_sim(dev) ((dev)->sim)
+#else
+#define dev_is_sim(dev) false
+#endif
+
 #define tcmu_errp(ctx, fmt, ...) if ((ctx)->err_print) { (ctx)->err_print((fmt),##__VA_ARGS__);}
 
+/*
+ * Storage behind each tcmulib_cmd handed out by libtcmu. cmd must stay
+ * the first member so a tcmulib_cmd pointer can be cast back.
+ */
+struct tcmu_cmd_slot {
+	struct tcmulib_cmd cmd;
+	struct tcmu_cmd_slot *next; /* free or completion list linkage */
+	bool pooled;	/* false if malloc()ed because it didn't fit */
+	bool inflight;	/* dequeued, not yet completed */
+	int result;	/* set by tcmulib_command_complete() */
+	uint64_t dequeue_ns; /* for latency stats and the trace */
+	uint64_t trace_seq; /* its trace entry's seq, 0 if not traced */
+
+	struct iovec iovec[TCMU_CMD_SLOT_IOVS];
+	uint8_t cdb[TCMU_CMD_SLOT_CDB_LEN];
+};
+
+/*
+ * Ring telemetry, see tcmulib_get_ring_stats(). Each half is only
+ * written by one thread at a time (the dequeuer, or whoever holds
+ * 'retiring'), so plain increments do.
+ */
+struct tcmu_ring_hist {
+	uint64_t fill[TCMULIB_HIST_BUCKETS];
+	uint64_t inflight[TCMULIB_HIST_BUCKETS];
+	uint64_t burst[TCMULIB_HIST_BUCKETS];	/* dequeue side only */
+	uint32_t max_fill;
+	uint32_t max_inflight;
+};
+
+/*
+ * An entry in a device's command trace. seq is the record's position
+ * in the trace plus one once it is fully written, and 0 while it's
+ * being written, so readers can tell a torn copy. The record is
+ * written when the command is taken off the ring; done_seq is set to
+ * seq once its completion time and status are filled in.
+ */
+struct tcmu_trace_ent {
+	uint64_t seq;
+	uint64_t done_seq;
+	struct tcmulib_trace_rec rec;
+};
+
+/* A cached configfs attribute, see tcmu_get_attribute() */
+struct tcmu_attr {
+	char name[48];
+	int val;
+};
+
+typedef darray(struct tcmu_attr) darray_attr;
+
 struct tcmu_device {
 	int fd;
 	struct tcmu_mailbox *map;
@@ -57,14 +184,96 @@ struct tcmu_device {
 	uint32_t cmd_tail;
 
 	char dev_name[16]; /* e.g. "uio14" */
+	unsigned int minor; /* e.g. 14 */
+	unsigned int index; /* in ctx->devices */
 	char tcm_hba_name[16]; /* e.g. "user_8" */
 	char tcm_dev_name[128]; /* e.g. "backup2" */
 	char cfgstring[256];
 
 	struct tcmulib_handler *handler;
 	struct tcmulib_context *ctx;
+#ifdef TCMU_SIM
+	bool sim; /* ring and fd belong to tcmu-sim, not uio */
+#endif
+	bool handed_over; /* fd and handover_tail came from another process */
+	uint32_t handover_tail;
 
 	void *hm_private; /* private ptr for handler module */
+	void *app_private; /* private ptr for the libtcmu user */
+
+	/* configfs attrib/ values and device size, see api.c */
+	pthread_rwlock_t attr_lock;
+	darray_attr attrs;
+	long long size; /* -1 if not cached */
+
+	struct tcmu_loop_source loop_src;
+	bool on_coalescing;		/* in ctx->coalescing */
+	unsigned int coalescing_index;
+
+	/*
+	 * Command descriptor slab, one slot per command the ring can
+	 * hold. Slots are only taken by the thread dequeueing commands
+	 * (free_slots is private to it); completing threads push them
+	 * back on returned_slots, which the dequeuer grabs wholesale
+	 * when it runs dry.
+	 */
+	struct tcmu_cmd_slot *slots;
+	unsigned int nr_slots;
+	unsigned int slots_used; /* slots handed out at least once */
+	struct tcmu_cmd_slot *free_slots;
+	struct tcmu_cmd_slot *returned_slots;
+
+	/*
+	 * Completed commands waiting to be written back to the ring.
+	 * Any thread may push; only the thread holding 'retiring' pops,
+	 * and it alone moves mb->cmd_tail.
+	 */
+	struct tcmu_cmd_slot *completed;
+	int retiring;
+	unsigned int inflight; /* dequeued, not yet retired to the ring */
+
+	/*
+	 * Doorbell coalescing, see tcmulib_set_notify_coalescing().
+	 * unnotified counts retired completions the kernel hasn't been
+	 * told about yet, the oldest of them since unnotified_since.
+	 */
+	unsigned int notify_batch; /* 0 means notify on every call */
+	unsigned int notify_delay_us;
+	unsigned int unnotified;
+	uint64_t unnotified_since; /* CLOCK_MONOTONIC ns */
+
+	struct tcmu_ring_hist dequeue_hist;
+	struct tcmu_ring_hist complete_hist;
+
+	/*
+	 * Updated by completing threads, see tcmulib_get_latency_stats()
+	 * and tcmulib_get_cmd_stats()
+	 */
+	struct tcmulib_lat_hist lat_hist[TCMULIB_CMD_CLASSES];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t not_handled;
+	uint64_t check_condition;
+
+	/*
+	 * Command trace, see tcmulib_get_trace(). Only the dequeuing
+	 * thread claims entries, by bumping trace_head; completing
+	 * threads fill in the entries of their commands.
+	 */
+	struct tcmu_trace_ent *trace; /* NULL if off */
+	unsigned int trace_mask; /* entries - 1, a power of two */
+	uint64_t trace_head; /* records ever written */
+
+	/* Replaces the write() to the uio fd, see tcmulib_set_notify_hook() */
+	void (*notify_hook)(struct tcmu_device *dev, void *data);
+	void *notify_hook_data;
 };
 
+/* libtcmu-loop.c */
+int tcmu_loop_init(struct tcmulib_context *ctx);
+void tcmu_loop_exit(struct tcmulib_context *ctx);
+int tcmu_loop_add_device(struct tcmu_device *dev);
+void tcmu_loop_del_device(struct tcmu_device *dev);
+void tcmu_loop_coalescing(struct tcmu_device *dev, bool on);
+
 #endif
@@ -23,19 +23,24 @@
 #define _BITS_UIO_H
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <assert.h>
-#include <dlfcn.h>
 #include <pthread.h>
 #include <signal.h>
 #include <glib.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
 #include <getopt.h>
 #include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <libkmod.h>
 #include <linux/target_core_user.h>
@@ -44,71 +49,150 @@
 #include "libtcmu.h"
 #include "tcmuhandler-generated.h"
 #include "version.h"
+#include "tcmu-metrics.h"
+#include "tcmu-handover.h"
+#include "tcmu-qos.h"
+#include "tcmu-dispatch.h"
+#include "tcmu-probes.h"
+#ifdef HAVE_IO_URING
+#include "tcmu-uring.h"
+#endif
 
 #define ARRAY_SIZE(X) (sizeof(X) / sizeof((X)[0]))
 
-static char *handler_path = DEFAULT_HANDLER_PATH;
-static bool debug = false;
+/* Max events a shared loop takes from epoll per wakeup */
+#define TCMUR_LOOP_EVENTS 64
+/*
+ * Bursts a device gets per turn on a shared loop, before the others,
+ * at the default QoS weight
+ */
+#define TCMUR_LOOP_BURSTS 4
+/*
+ * How often shared loops compare their loads, and the least imbalance,
+ * in commands per interval, worth moving a device for.
+ */
+#define TCMUR_REBALANCE_MS 1000
+#define TCMUR_REBALANCE_MIN 1000
+
+/* How soon to look at a ring again when there was no memory for its commands */
+#define TCMUR_NOMEM_RETRY_MS 10
 
-darray(struct tcmur_handler *) g_runner_handlers = darray_new();
+/* Longest a device being closed waits for the handler's commands */
+#define TCMUR_DRAIN_MS 5000
+
+static char *handler_path = DEFAULT_HANDLER_PATH;
+static unsigned int notify_batch;
+static unsigned int notify_delay_us = 50;
+static unsigned int busy_poll_us;
+static unsigned int nr_workers;
+static bool use_io_uring;
+static int nr_loops = -1; /* defaults to one per CPU */
+static unsigned int trace_size = TCMULIB_TRACE_DEFAULT;
+static char *metrics_path;
+static char *handover_path;
+
+struct tcmu_loop;
 
+/*
+ * Per device state. The device is served either by its own thread, or
+ * by one of the shared loops.
+ */
 struct tcmu_thread {
 	pthread_t thread_id;
 	struct tcmu_device *dev;
+	unsigned int index;		/* in g_threads */
+	struct tcmur_dispatch disp;	/* its --workers and async workers */
+	int wake_fd;			/* eventfd to kick the io_uring engine, or -1 */
+#ifdef HAVE_IO_URING
+	struct tcmur_uring *uring;
+#endif
+
+	bool shared;		/* served by the shared loops, see loop_safe() */
+
+	/* Set under g_loops_lock; NULL if the device has its own thread */
+	struct tcmu_loop *loop;
+	bool req_pending;	/* in loop->reqs, so it can't be moved yet */
+	bool detached;		/* the loop has let go of it, see loop_detach() */
+
+	/* Only touched by the loop serving the device */
+	bool on_flush;		/* in loop->flush */
+	bool on_again;		/* in loop->again */
+	bool wait_room;		/* for room in its queue, see loop_room() */
+	unsigned int credit;	/* see loop_run_device() */
+	uint64_t cmds;		/* taken off the ring since the last rebalance */
+	uint64_t load;		/* moving average of cmds */
+
+	/* Busy-poll state and stats, see wait_for_commands() */
+	uint64_t gap_ns;	/* moving average of idle gaps between bursts */
+	uint64_t spin_ns;
+	uint64_t sleep_ns;
+	uint64_t spin_hits;
+	uint64_t spin_misses;
+	uint64_t sleeps;
+
+	/* Only touched by whoever runs its commands, see next_commands() */
+	struct tcmur_qos qos;
+	struct tcmulib_cmd *held[TCMUR_CMD_BURST];	/* over its QoS limits */
+	int nr_held;
+	uint64_t held_since;
+	uint64_t retry_ns;	/* when to look at the ring again, see run_commands() */
+};
+
+typedef darray(struct tcmu_thread *) darray_thread;
+
+static darray_thread g_threads = darray_new();
+/* dev_added() runs on several threads at startup */
+static pthread_mutex_t g_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum tcmu_loop_op {
+	TCMU_LOOP_ATTACH,
+	TCMU_LOOP_DETACH,
+	TCMU_LOOP_KICK,		/* look at its ring again, see loop_room() */
 };
 
-static darray(struct tcmu_thread) g_threads = darray_new();
+struct tcmu_loop_req {
+	int op;		/* enum tcmu_loop_op */
+	struct tcmu_thread *thread;
+};
 
 /*
- * Debug API implementation
+ * A shared event loop thread, serving many devices through epoll.
+ * Devices are only added to and removed from its epoll set by the
+ * loop itself, between batches of events, so no event it is handed
+ * can refer to a device that's gone.
  */
-void dbgp(const char *fmt, ...)
-{
-	if (debug) {
-		va_list va;
-		va_start(va, fmt);
-		vprintf(fmt, va);
-		va_end(va);
-	}
-}
-
-void errp(const char *fmt, ...)
-{
-	va_list va;
+struct tcmu_loop {
+	pthread_t thread_id;
+	int epoll_fd;
+	int wake_fd;		/* eventfd, reqs were queued */
+
+	/* Under g_loops_lock */
+	darray_thread devs;
+	darray(struct tcmu_loop_req) reqs;
+	uint64_t load;		/* sum of its devices' loads */
+
+	/* Only touched by the loop thread */
+	darray_thread flush;	/* have a deadline, see device_timeout() */
+	darray_thread again;	/* left commands on their ring */
+	uint64_t next_rebalance;
+};
 
-	va_start(va, fmt);
-	vfprintf(stderr, fmt, va);
-	va_end(va);
-}
+static struct tcmu_loop *g_loops;	/* NULL if devices get their own threads */
+/* Device assignment, and the loops' devs, reqs and load */
+static pthread_mutex_t g_loops_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_loops_cond = PTHREAD_COND_INITIALIZER;
 
 static struct tcmur_handler *find_handler_by_subtype(gchar *subtype)
 {
-	struct tcmur_handler **handler;
+	struct runner_handler *rh;
 
-	darray_foreach(handler, g_runner_handlers) {
-		if (strcmp((*handler)->subtype, subtype) == 0)
-			return *handler;
+	darray_foreach(rh, g_runner_handlers) {
+		if (strcmp(rh->handler->subtype, subtype) == 0)
+			return rh->handler;
 	}
 	return NULL;
 }
 
-void tcmur_register_handler(struct tcmur_handler *handler)
-{
-	darray_append(g_runner_handlers, handler);
-}
-
-bool tcmur_unregister_handler(struct tcmur_handler *handler)
-{
-	int i;
-	for (i = 0; i < darray_size(g_runner_handlers); i++) {
-		if (darray_item(g_runner_handlers, i) == handler) {
-			darray_remove(g_runner_handlers, i);
-			return true;
-		}
-	}
-	return false;
-}
-
 static int is_handler(const struct dirent *dirent)
 {
 	if (strncmp(dirent->d_name, "handler_", 8))
@@ -131,8 +215,6 @@ static int open_handlers(void)
 
 	for (i = 0; i < num_handlers; i++) {
 		char *path;
-		void *handle;
-		void (*handler_init)(void);
 		int ret;
 
 		ret = asprintf(&path, "%s/%s", handler_path, dirent_list[i]->d_name);
@@ -141,23 +223,10 @@ static int open_handlers(void)
 			continue;
 		}
 
-		handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
-		if (!handle) {
-			errp("Could not open handler at %s: %s\n", path, dlerror());
-			free(path);
-			continue;
-		}
-
-		handler_init = dlsym(handle, "handler_init");
-		if (!handler_init) {
-			errp("dlsym failure on %s\n", path);
-			free(path);
-			continue;
-		}
-
-		handler_init();
-
+		ret = tcmur_open_handler(path);
 		free(path);
+		if (ret)
+			continue;
 
 		num_good++;
 	}
@@ -169,61 +238,426 @@ static int open_handlers(void)
 	return num_good;
 }
 
-static void thread_cleanup(void *arg)
+static uint64_t now_ns(void)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
-	struct tcmur_handler *r_handler = handler->hm_private;
+	struct timespec ts;
 
-	r_handler->close(dev);
-	free(dev);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void *thread_start(void *arg)
+struct tcmur_dispatch *tcmur_get_dispatch(struct tcmu_device *dev)
 {
-	struct tcmu_device *dev = arg;
-	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
-	struct tcmur_handler *r_handler = handler->hm_private;
-	struct pollfd pfd;
-	int ret;
+	struct tcmu_thread *thread = tcmulib_get_dev_data(dev);
+
+	return &thread->disp;
+}
+
+/*
+ * Microseconds until the device needs looking at even if no commands
+ * come in: to flush notifications held back, to run commands its QoS
+ * limits held back, or to retry commands there was no memory for. -1
+ * if it doesn't.
+ */
+static int device_timeout(struct tcmu_thread *thread)
+{
+	int timeout = tcmulib_get_notify_timeout(thread->dev);
+	int qos_timeout, retry;
+	uint64_t now;
+
+	if (thread->retry_ns) {
+		now = now_ns();
+		retry = thread->retry_ns > now ?
+			(thread->retry_ns - now + 999) / 1000 : 0;
+		if (timeout < 0 || retry < timeout)
+			timeout = retry;
+	}
+
+	/* Those held back wait for room in its queue first */
+	if (!thread->nr_held || thread->wait_room)
+		return timeout;
+
+	qos_timeout = tcmur_qos_timeout(&thread->qos, now_ns());
+	if (timeout < 0 || qos_timeout < timeout)
+		timeout = qos_timeout;
+	return timeout;
+}
 
-	pthread_cleanup_push(thread_cleanup, dev);
+/*
+ * Wait for commands the handler is still working on, e.g. with its
+ * own callbacks, to be completed back to the ring, so they aren't lost
+ * when it's closed or the device is handed over. Gives up after
+ * TCMUR_DRAIN_MS.
+ */
+static void drain_device(struct tcmu_thread *thread)
+{
+	struct tcmu_device *dev = thread->dev;
+	struct tcmulib_cmd_stats stats;
+	uint64_t deadline = now_ns() + TCMUR_DRAIN_MS * 1000000ULL;
 
 	while (1) {
-		int completed = 0;
-		struct tcmulib_cmd *cmd;
+		tcmulib_processing_complete(dev);
+		tcmulib_get_cmd_stats(dev, &stats);
+		if (!stats.inflight || now_ns() >= deadline)
+			break;
+#ifdef HAVE_IO_URING
+		/* Their I/O completes on the ring */
+		if (thread->uring) {
+			tcmur_uring_wait(thread->uring, 1000);
+			continue;
+		}
+#endif
+		usleep(1000);
+	}
 
-		tcmulib_processing_start(dev);
+	if (stats.inflight)
+		errp("%s: closing with %u commands in flight\n",
+		     tcmu_get_dev_cfgstring(dev), stats.inflight);
+}
 
-		while ((cmd = tcmulib_get_next_command(dev)) != NULL) {
-			int i;
-			bool short_cdb = cmd->cdb[0] <= 0x1f;
+static void run_held(struct tcmu_thread *thread);
 
-			for (i = 0; i < (short_cdb ? 6 : 10); i++) {
-				dbgp("%x ", cmd->cdb[i]);
-			}
-			dbgp("\n");
+/*
+ * Stop running the device's commands, and close it. Nothing may take
+ * commands off its ring any more.
+ */
+static void close_device(struct tcmu_thread *thread)
+{
+	struct tcmulib_handler *handler = tcmu_get_dev_handler(thread->dev);
+	struct tcmur_handler *r_handler = handler->hm_private;
 
-			ret = r_handler->handle_cmd(dev, cmd);
-			if (ret != TCMU_ASYNC_HANDLED) {
-				tcmulib_command_complete(dev, cmd, ret);
-				completed = 1;
-			}
+	/* Its limits don't matter any more */
+	run_held(thread);
+
+	tcmur_dispatch_stop(thread->dev, &thread->disp);
+
+	drain_device(thread);
+
+	r_handler->close(thread->dev);
+}
+
+static void thread_cleanup(void *arg)
+{
+	struct tcmu_thread *thread = arg;
+	struct tcmu_device *dev = thread->dev;
+
+	if (busy_poll_us)
+		dbgp("%s: spun %llu us (%llu hits, %llu misses), slept %llu us (%llu times)\n",
+		     tcmu_get_dev_cfgstring(dev),
+		     (unsigned long long) thread->spin_ns / 1000,
+		     (unsigned long long) thread->spin_hits,
+		     (unsigned long long) thread->spin_misses,
+		     (unsigned long long) thread->sleep_ns / 1000,
+		     (unsigned long long) thread->sleeps);
+
+	close_device(thread);
+
+	/* After close_device(), which may still need it for the handler's I/O */
+#ifdef HAVE_IO_URING
+	if (thread->uring) {
+		tcmur_uring_teardown(thread->uring);
+		thread->uring = NULL;
+	}
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * Spin on the ring for up to twice the usual gap between bursts,
+ * capped at --busy-poll-us. Gaps longer than the cap aren't worth
+ * spinning for at all.
+ */
+static bool spin_for_commands(struct tcmu_thread *thread, uint64_t start)
+{
+	uint64_t max = busy_poll_us * 1000ULL;
+	uint64_t budget;
+	uint64_t now = start;
+
+	if (!max || thread->gap_ns > max)
+		return false;
+
+	budget = thread->gap_ns * 2;
+	if (budget > max)
+		budget = max;
+
+	while (now - start < budget) {
+		if (tcmulib_has_next_command(thread->dev)) {
+			thread->spin_ns += now - start;
+			thread->spin_hits++;
+			return true;
 		}
+		cpu_relax();
+		now = now_ns();
+	}
 
-		if (completed)
-			tcmulib_processing_complete(dev);
+	thread->spin_ns += now - start;
+	thread->spin_misses++;
+	return false;
+}
 
-		pfd.fd = tcmu_get_dev_fd(dev);
-		pfd.events = POLLIN;
-		pfd.revents = 0;
+/*
+ * Wait until the device's ring has commands for us. Returns false if
+ * the device fd reported something unexpected.
+ */
+static bool wait_for_commands(struct tcmu_thread *thread)
+{
+	struct tcmu_device *dev = thread->dev;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t start, gap;
+	int timeout;
+
+	start = now_ns();
+
+	/* The ring may have commands, but they have to wait for QoS or memory */
+	if (!thread->nr_held && !thread->retry_ns &&
+	    spin_for_commands(thread, start)) {
+		gap = now_ns() - start;
+		goto out;
+	}
 
+	pfd.fd = tcmu_get_dev_fd(dev);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	/*
+	 * Wake up in time to flush any notification held back, or to run
+	 * the commands QoS held back.
+	 */
+	timeout = device_timeout(thread);
+	while (timeout >= 0) {
+		ts.tv_sec = timeout / 1000000;
+		ts.tv_nsec = (timeout % 1000000) * 1000;
+		if (ppoll(&pfd, 1, &ts, NULL) != 0)
+			break;
+		tcmulib_processing_complete(dev);
+		if (thread->nr_held && !tcmur_qos_timeout(&thread->qos, now_ns()))
+			break;
+		if (thread->retry_ns && thread->retry_ns <= now_ns())
+			break;
+		timeout = device_timeout(thread);
+	}
+	if (timeout < 0)
 		poll(&pfd, 1, -1);
 
-		if (pfd.revents != POLLIN) {
-			errp("poll received unexpected revent: 0x%x\n", pfd.revents);
+	gap = now_ns() - start;
+	thread->sleep_ns += gap;
+	thread->sleeps++;
+
+	if (pfd.revents && pfd.revents != POLLIN) {
+		errp("poll received unexpected revent: 0x%x\n", pfd.revents);
+		return false;
+	}
+
+out:
+	thread->gap_ns = (thread->gap_ns * 7 + gap) / 8;
+	return true;
+}
+
+/*
+ * The next burst of up to max commands to run: those the device's QoS
+ * limits held back, then more off the ring. Commands over the limits
+ * are held back in turn, and nothing more is taken off the ring until
+ * they've gone, so the rest wait there. Returns how many may run, 0 if
+ * there are none or none may yet.
+ */
+static int next_commands(struct tcmu_thread *thread, struct tcmulib_cmd **cmds,
+			 int max)
+{
+	struct tcmur_qos *qos = &thread->qos;
+	int nr_held = thread->nr_held;
+	int nr_cmds, nr_run;
+	uint64_t now;
+
+	if (!max)
+		return 0;
+
+	if (!tcmur_qos_update(qos) && !nr_held)
+		return tcmulib_get_next_commands(thread->dev, cmds, max);
+
+	now = now_ns();
+
+	if (nr_held) {
+		nr_cmds = nr_held < max ? nr_held : max;
+		memcpy(cmds, thread->held, nr_cmds * sizeof(*cmds));
+	} else {
+		nr_cmds = tcmulib_get_next_commands(thread->dev, cmds, max);
+		if (nr_cmds <= 0)
+			return nr_cmds;
+		thread->held_since = now;
+	}
+
+	/* Held back commands go anyway if the limits were lifted */
+	if (qos->active)
+		nr_run = tcmur_qos_admit(qos, cmds, nr_cmds, now);
+	else
+		nr_run = nr_cmds;
+
+	if (nr_held) {
+		qos->throttled_ns += nr_run * (now - thread->held_since);
+		/* Those that didn't run stay held, in order */
+		thread->nr_held = nr_held - nr_run;
+		memmove(thread->held, thread->held + nr_run,
+			thread->nr_held * sizeof(*cmds));
+	} else {
+		qos->throttled += nr_cmds - nr_run;
+		thread->nr_held = nr_cmds - nr_run;
+		memcpy(thread->held, cmds + nr_run,
+		       thread->nr_held * sizeof(*cmds));
+	}
+
+	return nr_run;
+}
+
+/* Run the commands QoS held back right away, whatever the limits */
+static void run_held(struct tcmu_thread *thread)
+{
+	int nr_held = thread->nr_held;
+
+	if (!nr_held)
+		return;
+
+	thread->nr_held = 0;
+	thread->qos.throttled_ns += nr_held * (now_ns() - thread->held_since);
+
+	if (thread->disp.wq)
+		tcmur_queue_commands(thread->disp.wq, thread->dev, thread->held,
+				     NULL, nr_held);
+	else if (tcmur_handle_commands(thread->dev, thread->held, NULL, nr_held))
+		tcmulib_processing_complete(thread->dev);
+}
+
+static void loop_kick(struct tcmu_device *dev);
+
+/*
+ * Most commands to take off the ring at once. A shared loop must not
+ * wait for room in a device's queue, as the other devices would wait
+ * with it. Instead it only takes off as many commands as there's room
+ * for, on the assumption that the handler submits at most one work per
+ * command, and leaves the rest on the ring until the workers kick it.
+ */
+static int loop_room(struct tcmu_thread *thread)
+{
+	struct tcmu_work_queue *wq;
+	unsigned int room;
+
+	if (!thread->shared)
+		return TCMUR_CMD_BURST;
+
+	/* Handlers on --workers submit work from the workers */
+	wq = thread->disp.wq ?: thread->disp.async_wq;
+	if (!wq)
+		return TCMUR_CMD_BURST;
+
+	room = tcmur_queue_room(wq, thread->dev, loop_kick);
+	if (!room)
+		thread->wait_room = true;
+	return room < TCMUR_CMD_BURST ? room : TCMUR_CMD_BURST;
+}
+
+/*
+ * Take up to max_cmds commands off the device's ring, a burst at a
+ * time, and run them or queue them for the workers. Returns true if the ring was
+ * emptied, what's left has to wait for the device's QoS limits, for
+ * room in its queue, or for memory.
+ */
+static bool run_commands(struct tcmu_thread *thread, int max_cmds)
+{
+	struct tcmu_device *dev = thread->dev;
+	struct tcmulib_cmd *cmds[TCMUR_CMD_BURST];
+	int completed = 0;
+	int nr_cmds, max;
+
+	thread->retry_ns = 0;
+	while (1) {
+		max = loop_room(thread);
+		nr_cmds = next_commands(thread, cmds,
+					max < max_cmds ? max : max_cmds);
+		if (nr_cmds <= 0)
 			break;
+
+		if (thread->disp.wq)
+			tcmur_queue_commands(thread->disp.wq, dev, cmds, NULL, nr_cmds);
+		else
+			completed += tcmur_handle_commands(dev, cmds, NULL, nr_cmds);
+
+		thread->cmds += nr_cmds;
+		max_cmds -= nr_cmds;
+		if (!max_cmds)
+			break;
+	}
+
+	/*
+	 * No memory for the next command, it and the rest stay on the
+	 * ring. Its fd won't say so again, so come back for them once
+	 * some may have been freed.
+	 */
+	if (nr_cmds == -ENOMEM) {
+		dbgp("%s: no memory for commands, trying again in %d ms\n",
+		     tcmu_get_dev_cfgstring(dev), TCMUR_NOMEM_RETRY_MS);
+		thread->retry_ns = now_ns() + TCMUR_NOMEM_RETRY_MS * 1000000ULL;
+		nr_cmds = 0;
+	}
+
+	if (completed)
+		tcmulib_processing_complete(dev);
+
+	return thread->nr_held || !nr_cmds || !tcmulib_has_next_command(dev);
+}
+
+static void *thread_start(void *arg)
+{
+	struct tcmu_thread *thread = arg;
+	struct tcmu_device *dev = thread->dev;
+
+	pthread_cleanup_push(thread_cleanup, thread);
+
+#ifdef HAVE_IO_URING
+	if (thread->wake_fd != -1) {
+		thread->uring = tcmur_uring_setup(dev, thread->wake_fd);
+		if (!thread->uring)
+			errp("%s: falling back to poll()\n", tcmu_get_dev_cfgstring(dev));
+	}
+#endif
+
+	while (1) {
+#ifdef HAVE_IO_URING
+		/* The ring clears the event when its poll of the uio fd fires */
+		if (!thread->uring)
+#endif
+			tcmulib_processing_start(dev);
+
+		/*
+		 * Cancelled only while waiting, so every command taken off
+		 * the ring has been handled or queued when it happens.
+		 */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		run_commands(thread, INT_MAX);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+#ifdef HAVE_IO_URING
+		if (thread->uring) {
+			int ret;
+
+			ret = tcmur_uring_wait(thread->uring,
+					       device_timeout(thread));
+			/* io_uring_enter() isn't a cancellation point */
+			pthread_testcancel();
+			if (ret < 0) {
+				errp("io_uring wait failed: %d\n", ret);
+				break;
+			}
+			continue;
 		}
+#endif
+
+		if (!wait_for_commands(thread))
+			break;
 	}
 
 	errp("thread terminating, should never happen\n");
@@ -233,18 +667,24 @@ static void *thread_start(void *arg)
 	return NULL;
 }
 
-static void cancel_thread(pthread_t thread)
+static void cancel_thread(struct tcmu_thread *thread)
 {
 	void *join_retval;
+	uint64_t val = 1;
 	int ret;
 
-	ret = pthread_cancel(thread);
+	ret = pthread_cancel(thread->thread_id);
 	if (ret) {
 		errp("pthread_cancel failed with value %d\n", ret);
 		return;
 	}
 
-	ret = pthread_join(thread, &join_retval);
+	/* Kick it out of io_uring_enter() so it sees the cancel */
+	if (thread->wake_fd != -1 &&
+	    write(thread->wake_fd, &val, sizeof(val)) == -1)
+		errp("could not wake device thread: %m\n");
+
+	ret = pthread_join(thread->thread_id, &join_retval);
 	if (ret) {
 		errp("pthread_join failed with value %d\n", ret);
 		return;
@@ -254,22 +694,678 @@ static void cancel_thread(pthread_t thread)
 		errp("unexpected join retval: %p\n", join_retval);
 }
 
-static void sighandler(int signal)
+static void wake_loop(struct tcmu_loop *loop)
+{
+	uint64_t val = 1;
+
+	if (write(loop->wake_fd, &val, sizeof(val)) == -1)
+		errp("could not wake event loop: %m\n");
+}
+
+/* Called with g_loops_lock held */
+static void queue_loop_req(struct tcmu_loop *loop, int op,
+			   struct tcmu_thread *thread)
+{
+	struct tcmu_loop_req req = { .op = op, .thread = thread };
+
+	thread->req_pending = true;
+	darray_append(loop->reqs, req);
+	wake_loop(loop);
+}
+
+static void list_del(darray_thread *list, struct tcmu_thread *thread)
+{
+	int i;
+
+	for (i = 0; i < darray_size(*list); i++) {
+		if (darray_item(*list, i) == thread) {
+			darray_item(*list, i) = darray_item(*list, darray_size(*list) - 1);
+			darray_resize(*list, darray_size(*list) - 1);
+			return;
+		}
+	}
+}
+
+/* Stop serving a device. Called on the loop thread, with g_loops_lock held */
+static void loop_unlink(struct tcmu_loop *loop, struct tcmu_thread *thread)
+{
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, tcmu_get_dev_fd(thread->dev), NULL);
+
+	if (thread->on_flush)
+		list_del(&loop->flush, thread);
+	if (thread->on_again)
+		list_del(&loop->again, thread);
+	thread->on_flush = thread->on_again = false;
+
+	list_del(&loop->devs, thread);
+	if (loop->load > thread->load)
+		loop->load -= thread->load;
+	else
+		loop->load = 0;
+}
+
+static void process_loop_reqs(struct tcmu_loop *loop)
+{
+	struct tcmu_loop_req *req;
+	struct epoll_event ev;
+	uint64_t val;
+
+	if (read(loop->wake_fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+		errp("could not clear event loop eventfd: %m\n");
+
+	pthread_mutex_lock(&g_loops_lock);
+
+	darray_foreach(req, loop->reqs) {
+		struct tcmu_thread *thread = req->thread;
+
+		thread->req_pending = false;
+		switch (req->op) {
+		case TCMU_LOOP_ATTACH:
+			ev.events = EPOLLIN;
+			ev.data.ptr = thread;
+			if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD,
+				      tcmu_get_dev_fd(thread->dev), &ev) == -1)
+				errp("could not add %s to event loop: %m\n",
+				     tcmu_get_dev_cfgstring(thread->dev));
+
+			/* It may come with notifications held back */
+			thread->on_flush = true;
+			darray_append(loop->flush, thread);
+
+			/* and with commands waiting, if it was handed over */
+			thread->on_again = true;
+			darray_append(loop->again, thread);
+			break;
+		case TCMU_LOOP_KICK:
+			thread->wait_room = false;
+			if (!thread->on_again) {
+				thread->on_again = true;
+				darray_append(loop->again, thread);
+			}
+			break;
+		case TCMU_LOOP_DETACH:
+			loop_unlink(loop, thread);
+			thread->loop = NULL;
+			thread->detached = true;
+			pthread_cond_broadcast(&g_loops_cond);
+			break;
+		}
+	}
+	darray_resize(loop->reqs, 0);
+
+	pthread_mutex_unlock(&g_loops_lock);
+}
+
+/*
+ * Flush notifications held back past their deadline, queue devices
+ * whose commands QoS held back may now run, and work out how long
+ * epoll may sleep before the next deadline.
+ */
+static int flush_notifications(struct tcmu_loop *loop)
+{
+	struct tcmu_thread *thread;
+	int timeout = -1;
+	int dev_timeout;
+	int i = 0;
+
+	while (i < darray_size(loop->flush)) {
+		thread = darray_item(loop->flush, i);
+
+		dev_timeout = device_timeout(thread);
+		if (dev_timeout == 0) {
+			tcmulib_processing_complete(thread->dev);
+			if ((thread->nr_held || thread->retry_ns) &&
+			    !thread->on_again) {
+				thread->on_again = true;
+				darray_append(loop->again, thread);
+			}
+			dev_timeout = device_timeout(thread);
+		}
+		if (dev_timeout < 0) {
+			thread->on_flush = false;
+			darray_item(loop->flush, i) =
+				darray_item(loop->flush, darray_size(loop->flush) - 1);
+			darray_resize(loop->flush, darray_size(loop->flush) - 1);
+			continue;
+		}
+
+		/* epoll only does milliseconds, round up */
+		dev_timeout = (dev_timeout + 999) / 1000;
+		if (timeout < 0 || dev_timeout < timeout)
+			timeout = dev_timeout;
+		i++;
+	}
+
+	return timeout;
+}
+
+/*
+ * Deficit round robin: each turn adds to the commands the device may
+ * run by its QoS weight, and what it doesn't get to run is carried
+ * over, in hundredths of a command, so busy devices share the loop in
+ * the ratio of their weights however small those are.
+ */
+static void loop_run_device(struct tcmu_loop *loop, struct tcmu_thread *thread)
+{
+	uint64_t cmds = thread->cmds;
+	int max_cmds;
+
+	thread->credit += TCMUR_LOOP_BURSTS * TCMUR_CMD_BURST *
+			  thread->qos.limits.weight;
+	max_cmds = thread->credit / TCMUR_QOS_WEIGHT_DEFAULT;
+
+	tcmulib_processing_start(thread->dev);
+
+	if (max_cmds && run_commands(thread, max_cmds)) {
+		/* Nothing left it could run, it doesn't save up for later */
+		thread->credit = 0;
+	} else {
+		thread->credit -= (thread->cmds - cmds) * TCMUR_QOS_WEIGHT_DEFAULT;
+
+		/* Don't let one busy device hold up the rest, come back to it */
+		if (!thread->on_again) {
+			thread->on_again = true;
+			darray_append(loop->again, thread);
+		}
+	}
+
+	if (!thread->on_flush && device_timeout(thread) >= 0) {
+		thread->on_flush = true;
+		darray_append(loop->flush, thread);
+	}
+}
+
+static void loop_run_again(struct tcmu_loop *loop)
+{
+	struct tcmu_thread *again[TCMUR_LOOP_EVENTS];
+	int nr_again = 0;
+
+	/* Those that still have commands left go back on the list */
+	while (darray_size(loop->again) && nr_again < TCMUR_LOOP_EVENTS) {
+		again[nr_again] = darray_item(loop->again, darray_size(loop->again) - 1);
+		again[nr_again]->on_again = false;
+		darray_resize(loop->again, darray_size(loop->again) - 1);
+		nr_again++;
+	}
+
+	while (nr_again--)
+		loop_run_device(loop, again[nr_again]);
+}
+
+/*
+ * Move one of our devices to the least loaded loop, if the difference
+ * is worth it. The busiest device that leaves us no less loaded than
+ * the other loop is picked, so a hot device ends up with a loop to
+ * itself while the others move away.
+ */
+static void rebalance(struct tcmu_loop *loop)
 {
+	struct tcmu_loop *target = NULL;
+	struct tcmu_thread **thread;
+	struct tcmu_thread *move = NULL;
+	uint64_t load = 0;
+	uint64_t diff;
+	int i;
+
+	pthread_mutex_lock(&g_loops_lock);
+
+	darray_foreach(thread, loop->devs) {
+		(*thread)->load = ((*thread)->load * 3 + (*thread)->cmds) / 4;
+		(*thread)->cmds = 0;
+		load += (*thread)->load;
+	}
+	loop->load = load;
+
+	for (i = 0; i < nr_loops; i++) {
+		if (!target || g_loops[i].load < target->load)
+			target = &g_loops[i];
+	}
+
+	if (target == loop || darray_size(loop->devs) < 2)
+		goto out;
+
+	diff = loop->load - target->load;
+	if (diff < TCMUR_REBALANCE_MIN)
+		goto out;
+
+	darray_foreach(thread, loop->devs) {
+		/* Not added to our epoll set yet, or about to be removed */
+		if ((*thread)->req_pending)
+			continue;
+		if ((*thread)->load && (*thread)->load <= diff / 2 &&
+		    (!move || (*thread)->load > move->load))
+			move = *thread;
+	}
+	if (!move)
+		goto out;
+
+	dbgp("%s: moving to a less busy event loop\n",
+	     tcmu_get_dev_cfgstring(move->dev));
+
+	loop_unlink(loop, move);
+	move->loop = target;
+	darray_append(target->devs, move);
+	target->load += move->load;
+	queue_loop_req(target, TCMU_LOOP_ATTACH, move);
+
+out:
+	pthread_mutex_unlock(&g_loops_lock);
+}
+
+static void *loop_start(void *arg)
+{
+	struct tcmu_loop *loop = arg;
+	struct epoll_event events[TCMUR_LOOP_EVENTS];
 	struct tcmu_thread *thread;
+	bool woken;
+	int nr_events;
+	int timeout;
+	uint64_t now;
+	int i;
+
+	loop->next_rebalance = now_ns() + TCMUR_REBALANCE_MS * 1000000ULL;
+
+	/*
+	 * Cancelled only while waiting, so every command taken off a ring
+	 * has been handled or queued, and no request is half done, when it
+	 * happens. See thread_start().
+	 */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (1) {
+		timeout = flush_notifications(loop);
+		if (darray_size(loop->again))
+			timeout = 0;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		nr_events = epoll_wait(loop->epoll_fd, events, TCMUR_LOOP_EVENTS, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (nr_events == -1) {
+			if (errno == EINTR)
+				continue;
+			errp("epoll_wait failed: %m\n");
+			break;
+		}
+
+		loop_run_again(loop);
+
+		woken = false;
+		for (i = 0; i < nr_events; i++) {
+			thread = events[i].data.ptr;
+			if (!thread)
+				woken = true;
+			else
+				loop_run_device(loop, thread);
+		}
+
+		/* Only between batches, see struct tcmu_loop */
+		if (woken)
+			process_loop_reqs(loop);
+
+		now = now_ns();
+		if (now >= loop->next_rebalance) {
+			rebalance(loop);
+			loop->next_rebalance = now + TCMUR_REBALANCE_MS * 1000000ULL;
+		}
+	}
+
+	errp("event loop terminating, should never happen\n");
+
+	return NULL;
+}
+
+static int start_loops(void)
+{
+	struct tcmu_loop *loop;
+	struct epoll_event ev;
+	int ret;
+	int i;
+
+	g_loops = calloc(nr_loops, sizeof(*g_loops));
+	if (!g_loops)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_loops; i++) {
+		loop = &g_loops[i];
+		darray_init(loop->devs);
+		darray_init(loop->reqs);
+		darray_init(loop->flush);
+		darray_init(loop->again);
+
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd == -1)
+			return -errno;
+
+		loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (loop->wake_fd == -1)
+			return -errno;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1)
+			return -errno;
+
+		ret = pthread_create(&loop->thread_id, NULL, loop_start, loop);
+		if (ret)
+			return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a device may be served by a shared loop, which runs the other
+ * devices' commands too, so it must never block in the handler. Only
+ * if the handler says it just starts the commands' I/O, or the device's
+ * commands run on --workers anyway.
+ */
+static bool loop_safe(struct tcmu_thread *thread,
+		      struct tcmur_handler *r_handler)
+{
+	return thread->disp.wq ||
+		(thread->disp.handler_version >= 1 && r_handler->nonblocking);
+}
+
+/* Hand a new device to the least loaded loop, or the one with fewest devices */
+static void loop_attach(struct tcmu_thread *thread)
+{
+	struct tcmu_loop *loop = NULL;
+	int i;
+
+	pthread_mutex_lock(&g_loops_lock);
+
+	for (i = 0; i < nr_loops; i++) {
+		if (!loop || g_loops[i].load < loop->load ||
+		    (g_loops[i].load == loop->load &&
+		     darray_size(g_loops[i].devs) < darray_size(loop->devs)))
+			loop = &g_loops[i];
+	}
+
+	thread->loop = loop;
+	darray_append(loop->devs, thread);
+	queue_loop_req(loop, TCMU_LOOP_ATTACH, thread);
 
-	errp("signal %d received!\n", signal);
+	pthread_mutex_unlock(&g_loops_lock);
+}
+
+/*
+ * Called by a worker once there's room in the queue a device on a loop
+ * is waiting on, see loop_room().
+ */
+static void loop_kick(struct tcmu_device *dev)
+{
+	struct tcmu_thread *thread = tcmulib_get_dev_data(dev);
+
+	pthread_mutex_lock(&g_loops_lock);
+	/* Unless it's being removed */
+	if (thread->loop)
+		queue_loop_req(thread->loop, TCMU_LOOP_KICK, thread);
+	pthread_mutex_unlock(&g_loops_lock);
+}
+
+/* Take a device off whichever loop is serving it, and wait for that */
+static void loop_detach(struct tcmu_thread *thread)
+{
+	pthread_mutex_lock(&g_loops_lock);
+
+	queue_loop_req(thread->loop, TCMU_LOOP_DETACH, thread);
+	while (!thread->detached)
+		pthread_cond_wait(&g_loops_cond, &g_loops_lock);
+
+	pthread_mutex_unlock(&g_loops_lock);
+}
+
+static void cancel_loops(void)
+{
+	void *join_retval;
+	int i;
+
+	for (i = 0; i < nr_loops; i++) {
+		if (pthread_cancel(g_loops[i].thread_id))
+			continue;
+		pthread_join(g_loops[i].thread_id, &join_retval);
+	}
+}
+
+/*
+ * Runs from the main loop, not in signal context: closing devices
+ * takes locks, joins threads and waits for the handlers.
+ */
+static gboolean handle_sigint(gpointer data)
+{
+	struct tcmu_thread **thread;
+
+	errp("signal %d received!\n", SIGINT);
+
+	if (g_loops)
+		cancel_loops();
 
 	darray_foreach(thread, g_threads) {
-		cancel_thread(thread->thread_id);
+		if ((*thread)->shared)
+			close_device(*thread);
+		else
+			cancel_thread(*thread);
 	}
 
 	exit(1);
 }
 
-static struct sigaction tcmu_sigaction = {
-	.sa_handler = sighandler,
-};
+static struct tcmur_dev_metrics *collect_metrics(int *count)
+{
+	struct tcmur_dev_metrics *devs, *m;
+	struct tcmur_qos_limits limits;
+	struct tcmu_thread *thread;
+	int i;
+
+	/* Only taken by devices coming and going, never by I/O */
+	pthread_mutex_lock(&g_threads_lock);
+
+	*count = darray_size(g_threads);
+	devs = calloc(*count ?: 1, sizeof(*devs));
+	if (!devs)
+		goto out;
+
+	for (i = 0; i < *count; i++) {
+		thread = darray_item(g_threads, i);
+		m = &devs[i];
+
+		tcmur_metrics_read_dev(thread->dev, m);
+
+		/* Racy reads of the device thread's counters, it's only stats */
+		m->busy_poll = busy_poll_us;
+		m->spin_ns = thread->spin_ns;
+		m->sleep_ns = thread->sleep_ns;
+		m->spin_hits = thread->spin_hits;
+		m->spin_misses = thread->spin_misses;
+		m->sleeps = thread->sleeps;
+
+		tcmur_qos_get(&thread->qos, &limits);
+		m->qos_iops = limits.iops;
+		m->qos_bps = limits.bps;
+		m->qos_weight = limits.weight;
+		m->qos_throttled = thread->qos.throttled;
+		m->qos_throttled_ns = thread->qos.throttled_ns;
+		m->qos_held = thread->nr_held;
+	}
+
+out:
+	pthread_mutex_unlock(&g_threads_lock);
+	return devs;
+}
+
+static void dump_latency(struct tcmu_device *dev, struct tcmulib_lat_hist *hist)
+{
+	static const char *names[TCMULIB_CMD_CLASSES] = {
+		[TCMULIB_CMD_OTHER] = "other",
+		[TCMULIB_CMD_READ] = "read",
+		[TCMULIB_CMD_WRITE] = "write",
+		[TCMULIB_CMD_FLUSH] = "flush",
+	};
+	int i;
+
+	printf("%s: latency us\n", tcmu_get_dev_cfgstring(dev));
+	printf("  %-6s %12s %10s %10s %10s %10s %10s\n", "class", "commands",
+	       "mean", "p50", "p99", "p99.9", "max");
+
+	for (i = 0; i < TCMULIB_CMD_CLASSES; i++) {
+		tcmulib_get_latency_stats(dev, i, hist);
+		if (!hist->count)
+			continue;
+
+		printf("  %-6s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       names[i], (unsigned long long) hist->count,
+		       hist->sum_ns / 1000.0 / hist->count,
+		       tcmulib_lat_percentile(hist, 50) / 1000.0,
+		       tcmulib_lat_percentile(hist, 99) / 1000.0,
+		       tcmulib_lat_percentile(hist, 99.9) / 1000.0,
+		       hist->max_ns / 1000.0);
+	}
+}
+
+static void dump_qos(struct tcmu_thread *thread)
+{
+	struct tcmur_qos_limits limits;
+
+	tcmur_qos_get(&thread->qos, &limits);
+	if (!limits.iops && !limits.bps && !thread->qos.throttled &&
+	    limits.weight == TCMUR_QOS_WEIGHT_DEFAULT)
+		return;
+
+	printf("%s: qos %llu iops, %llu bytes/s, weight %u; %llu commands held back, %llu us in all\n",
+	       tcmu_get_dev_cfgstring(thread->dev),
+	       (unsigned long long) limits.iops,
+	       (unsigned long long) limits.bps, limits.weight,
+	       (unsigned long long) thread->qos.throttled,
+	       (unsigned long long) thread->qos.throttled_ns / 1000);
+}
+
+/*
+ * Print every device's latencies, QoS, and if tracing is on, its
+ * command trace, oldest command first.
+ */
+static gboolean dump_stats(gpointer data)
+{
+	struct tcmulib_trace_rec *recs = NULL;
+	struct tcmulib_lat_hist *hist;
+	struct tcmu_thread **thread;
+	int nr_recs, i;
+
+	hist = malloc(sizeof(*hist));
+	if (trace_size)
+		recs = malloc(trace_size * sizeof(*recs));
+	if (!hist || (trace_size && !recs)) {
+		errp("ENOMEM\n");
+		goto out;
+	}
+
+	pthread_mutex_lock(&g_threads_lock);
+	darray_foreach(thread, g_threads) {
+		struct tcmu_device *dev = (*thread)->dev;
+
+		dump_latency(dev, hist);
+		dump_qos(*thread);
+		if (!recs)
+			continue;
+
+		nr_recs = tcmulib_get_trace(dev, recs, trace_size);
+		printf("%s: last %d commands\n", tcmu_get_dev_cfgstring(dev), nr_recs);
+		printf("  %16s %10s %6s %6s %16s %8s %6s\n", "dequeued ns",
+		       "took ns", "cmd_id", "opcode", "lba", "len", "status");
+
+		for (i = 0; i < nr_recs; i++) {
+			/* Still in flight */
+			if (!recs[i].complete_ns) {
+				printf("  %16llu %10s %6u %6x %16llu %8u %6s\n",
+				       (unsigned long long) recs[i].dequeue_ns,
+				       "-", recs[i].cmd_id, recs[i].opcode,
+				       (unsigned long long) recs[i].lba,
+				       recs[i].xfer_len, "-");
+				continue;
+			}
+
+			printf("  %16llu %10llu %6u %6x %16llu %8u %6x\n",
+			       (unsigned long long) recs[i].dequeue_ns,
+			       (unsigned long long) (recs[i].complete_ns - recs[i].dequeue_ns),
+			       recs[i].cmd_id, recs[i].opcode,
+			       (unsigned long long) recs[i].lba,
+			       recs[i].xfer_len, recs[i].status);
+		}
+	}
+	pthread_mutex_unlock(&g_threads_lock);
+	fflush(stdout);
+
+out:
+	free(recs);
+	free(hist);
+	return TRUE;
+}
+
+/* Stop serving the device and close it, for dev_removed() to forget */
+static void stop_device(struct tcmu_thread *thread)
+{
+	if (thread->shared) {
+		loop_detach(thread);
+		close_device(thread);
+	} else {
+		cancel_thread(thread);
+	}
+}
+
+/*
+ * The new runner claims a device: stop it once the commands it has are
+ * done and give it up, while the others carry on until they're claimed
+ * in turn.
+ */
+static int release_device(const char *dev_name, struct tcmulib_handover *h)
+{
+	struct tcmu_thread **thread;
+	struct tcmu_device *dev = NULL;
+	unsigned int minor;
+	int ret;
+
+	if (sscanf(dev_name, "uio%u", &minor) != 1)
+		return 1;
+
+	pthread_mutex_lock(&g_threads_lock);
+	darray_foreach(thread, g_threads) {
+		if (tcmu_get_dev_minor((*thread)->dev) == minor) {
+			dev = (*thread)->dev;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_threads_lock);
+	if (!dev)
+		return 1;
+
+	/* Stops it through dev_removed(), which takes it off g_threads */
+	ret = tcmulib_handover_device(dev, h);
+	if (ret)
+		errp("%s: could not hand over device: %d\n",
+		     tcmu_get_dev_cfgstring(dev), ret);
+	return ret;
+}
+
+/*
+ * A new runner wants our devices: give each up as it claims it, and
+ * once it has all it wants, leave, which also lets it have the D-Bus
+ * name. If it goes away first, the devices it took went with it, but
+ * we keep serving the rest.
+ */
+static void handover_devices(int sock)
+{
+	uint64_t start = now_ns();
+	int ret;
+
+	ret = tcmur_handover_serve(sock, release_device);
+	if (ret < 0) {
+		errp("new runner went away during the handover: %d\n", ret);
+		return;
+	}
+
+	dbgp("handed %d devices over in %llu us, exiting\n", ret,
+	     (unsigned long long) (now_ns() - start) / 1000);
+	exit(0);
+}
 
 gboolean tcmulib_callback(GIOChannel *source,
 			  GIOCondition condition,
@@ -527,21 +1623,127 @@ void dbus_handler_manager1_init(GDBusConnection *connection)
 		g_error_free(error);
 }
 
+/* Called with g_threads_lock held */
+static struct tcmu_thread *find_thread(const char *device)
+{
+	struct tcmu_thread **thread;
+
+	darray_foreach(thread, g_threads) {
+		if (!strcmp(tcmu_get_dev_cfgstring((*thread)->dev), device))
+			return *thread;
+	}
+
+	return NULL;
+}
+
+static gboolean
+on_set_limits(TCMUService1Qos1 *interface,
+	      GDBusMethodInvocation *invocation,
+	      gchar *device,
+	      guint64 iops,
+	      guint64 bps,
+	      guint64 iops_burst,
+	      guint64 bps_burst,
+	      guint weight,
+	      gpointer user_data)
+{
+	struct tcmur_qos_limits limits = {
+		.iops = iops,
+		.bps = bps,
+		.iops_burst = iops_burst,
+		.bps_burst = bps_burst,
+		.weight = weight,
+	};
+	struct tcmu_thread *thread;
+	char *reason = "succeeded";
+	gboolean ok = FALSE;
+
+	pthread_mutex_lock(&g_threads_lock);
+	thread = find_thread(device);
+	if (!thread)
+		reason = "unknown device";
+	else if (tcmur_qos_set(&thread->qos, &limits))
+		reason = "invalid limits";
+	else
+		ok = TRUE;
+	pthread_mutex_unlock(&g_threads_lock);
+
+	if (ok)
+		dbgp("%s: qos %llu iops, %llu bytes/s, weight %u\n", device,
+		     (unsigned long long) iops, (unsigned long long) bps, weight);
+
+	g_dbus_method_invocation_return_value(invocation,
+		g_variant_new("(bs)", ok, reason));
+	return TRUE;
+}
+
+static gboolean
+on_get_limits(TCMUService1Qos1 *interface,
+	      GDBusMethodInvocation *invocation,
+	      gchar *device,
+	      gpointer user_data)
+{
+	struct tcmur_qos_limits limits = { 0 };
+	struct tcmu_thread *thread;
+
+	pthread_mutex_lock(&g_threads_lock);
+	thread = find_thread(device);
+	if (thread)
+		tcmur_qos_get(&thread->qos, &limits);
+	pthread_mutex_unlock(&g_threads_lock);
+
+	g_dbus_method_invocation_return_value(invocation,
+		g_variant_new("(bsttttu)", thread != NULL,
+			      thread ? "succeeded" : "unknown device",
+			      (guint64) limits.iops, (guint64) limits.bps,
+			      (guint64) limits.iops_burst,
+			      (guint64) limits.bps_burst, limits.weight));
+	return TRUE;
+}
+
+static void dbus_qos1_init(GDBusConnection *connection)
+{
+	GError *error = NULL;
+	TCMUService1Qos1 *interface;
+	gboolean ret;
+
+	interface = tcmuservice1_qos1_skeleton_new();
+	ret = g_dbus_interface_skeleton_export(
+			G_DBUS_INTERFACE_SKELETON(interface),
+			connection,
+			"/org/kernel/TCMUService1/Qos1",
+			&error);
+	g_signal_connect(interface,
+			 "handle-set-limits",
+			 G_CALLBACK (on_set_limits),
+			 NULL);
+	g_signal_connect(interface,
+			 "handle-get-limits",
+			 G_CALLBACK (on_get_limits),
+			 NULL);
+	if (!ret)
+		errp("QoS export failed: %s\n",
+		     error ? error->message : "unknown error");
+	if (error)
+		g_error_free(error);
+}
+
 static void dbus_bus_acquired(GDBusConnection *connection,
 			      const gchar *name,
 			      gpointer user_data)
 {
-	struct tcmur_handler **handler;
+	struct runner_handler *rh;
 
 	dbgp("bus %s acquired\n", name);
 
 	manager = g_dbus_object_manager_server_new("/org/kernel/TCMUService1");
 
-	darray_foreach(handler, g_runner_handlers) {
-		dbus_export_handler(*handler, G_CALLBACK(on_check_config));
+	darray_foreach(rh, g_runner_handlers) {
+		dbus_export_handler(rh->handler, G_CALLBACK(on_check_config));
 	}
 
 	dbus_handler_manager1_init(connection);
+	dbus_qos1_init(connection);
 	g_dbus_object_manager_server_set_connection(manager, connection);
 }
 
@@ -597,50 +1799,101 @@ int load_our_module(void) {
 static int dev_added(struct tcmu_device *dev)
 {
 	int ret;
-	struct tcmu_thread thread;
+	struct tcmu_thread *thread;
 	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
 	struct tcmur_handler *r_handler = handler->hm_private;
 
+	thread = calloc(1, sizeof(*thread));
+	if (!thread)
+		return -ENOMEM;
+
+	thread->dev = dev;
+	thread->wake_fd = -1;
+	tcmur_qos_init(&thread->qos);
+	tcmur_dispatch_init(&thread->disp, r_handler);
+	/* So open() can already use tcmur_set_async_limits() */
+	tcmulib_set_dev_data(dev, thread);
+
+	/* Runner-wide defaults, handlers may pick their own in open() */
+	tcmulib_set_notify_coalescing(dev, notify_batch, notify_delay_us);
+	if (trace_size != TCMULIB_TRACE_DEFAULT &&
+	    tcmulib_set_trace_size(dev, trace_size))
+		errp("%s: could not resize command trace\n",
+		     tcmu_get_dev_cfgstring(dev));
+
 	ret = r_handler->open(dev);
 	if (ret)
-		return ret;
+		goto err_free;
 
-	thread.dev = dev;
+	if (use_io_uring) {
+		thread->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (thread->wake_fd == -1) {
+			ret = -errno;
+			goto err_close;
+		}
+	}
 
-	ret = pthread_create(&thread.thread_id, NULL, thread_start, dev);
-	if (ret) {
-		r_handler->close(dev);
-		return ret;
+	ret = tcmur_dispatch_start(dev, &thread->disp, nr_workers);
+	if (ret)
+		goto err_close_wake;
+
+	thread->shared = g_loops && loop_safe(thread, r_handler);
+	if (thread->shared) {
+		loop_attach(thread);
+	} else {
+		ret = pthread_create(&thread->thread_id, NULL, thread_start, thread);
+		if (ret) {
+			ret = -ret;
+			goto err_stop_workers;
+		}
 	}
 
+	pthread_mutex_lock(&g_threads_lock);
+	thread->index = darray_size(g_threads);
 	darray_append(g_threads, thread);
+	pthread_mutex_unlock(&g_threads_lock);
 
 	return 0;
+
+err_stop_workers:
+	tcmur_dispatch_stop(dev, &thread->disp);
+err_close_wake:
+	if (thread->wake_fd != -1)
+		close(thread->wake_fd);
+err_close:
+	r_handler->close(dev);
+err_free:
+	tcmulib_set_dev_data(dev, NULL);
+	tcmur_qos_destroy(&thread->qos);
+	free(thread);
+	return ret;
 }
 
 static void dev_removed(struct tcmu_device *dev)
 {
-	struct tcmu_thread *thread;
-	int i = 0;
-	bool found = false;
-
-	darray_foreach(thread, g_threads) {
-		if (thread->dev == dev) {
-			found = true;
-			break;
-		} else {
-			i++;
-		}
-	}
+	struct tcmu_thread *thread = tcmulib_get_dev_data(dev);
+	struct tcmu_thread *last;
 
-	if (!found) {
+	if (!thread) {
 		errp("could not remove a device: not found\n");
 		return;
 	}
 
-	cancel_thread(thread->thread_id);
-
-	darray_remove(g_threads, i);
+	stop_device(thread);
+
+	/* Order doesn't matter, fill the hole with the last one */
+	pthread_mutex_lock(&g_threads_lock);
+	last = darray_item(g_threads, darray_size(g_threads) - 1);
+	darray_item(g_threads, thread->index) = last;
+	last->index = thread->index;
+	darray_resize(g_threads, darray_size(g_threads) - 1);
+	pthread_mutex_unlock(&g_threads_lock);
+
+	tcmulib_set_dev_data(dev, NULL);
+	if (thread->wake_fd != -1)
+		close(thread->wake_fd);
+	tcmur_qos_destroy(&thread->qos);
+	free(thread);
 }
 
 static void usage(void) {
@@ -652,6 +1905,27 @@ static void usage(void) {
 	printf("\t-d, --debug: enable debug messages\n");
 	printf("\t--handler-path: set path to search for handler modules\n");
 	printf("\t\tdefault is %s\n", DEFAULT_HANDLER_PATH);
+	printf("\t--notify-batch: completions to coalesce per kernel notification\n");
+	printf("\t\tdefault is 0 (notify right away)\n");
+	printf("\t--notify-delay-us: longest a coalesced notification is held back\n");
+	printf("\t\tdefault is 50\n");
+	printf("\t--busy-poll-us: longest to spin on an idle ring before sleeping\n");
+	printf("\t\tdefault is 0 (always sleep)\n");
+	printf("\t--workers: threads running each device's commands, for handlers\n");
+	printf("\t\tthat allow it. default is 0 (run on the device's own thread)\n");
+	printf("\t--io-uring: wait for commands, notify the kernel and do handler I/O\n");
+	printf("\t\tthrough io_uring\n");
+	printf("\t--loop-threads: event loop threads shared by devices whose handler\n");
+	printf("\t\tnever blocks, or that use --workers. default is one per CPU,\n");
+	printf("\t\t0 gives each device its own thread\n");
+	printf("\t--metrics-socket: serve Prometheus metrics on a unix socket at\n");
+	printf("\t\tthis path. default is off\n");
+	printf("\t--handover-socket: take devices over from a tcmu-runner\n");
+	printf("\t\tlistening on this unix socket, if any, then listen on it\n");
+	printf("\t\tto hand them over to the next. default is off\n");
+	printf("\t--trace-size: commands kept in each device's trace, printed on\n");
+	printf("\t\tSIGUSR1 with its latencies. default is %d, 0 turns tracing off\n",
+	       TCMULIB_TRACE_DEFAULT);
 	printf("\n");
 }
 
@@ -660,6 +1934,15 @@ static struct option long_options[] = {
 	{"handler-path", required_argument, 0, 0},
 	{"help", no_argument, 0, 'h'},
 	{"version", no_argument, 0, 'V'},
+	{"notify-batch", required_argument, 0, 0},
+	{"notify-delay-us", required_argument, 0, 0},
+	{"busy-poll-us", required_argument, 0, 0},
+	{"workers", required_argument, 0, 0},
+	{"io-uring", no_argument, 0, 0},
+	{"loop-threads", required_argument, 0, 0},
+	{"trace-size", required_argument, 0, 0},
+	{"metrics-socket", required_argument, 0, 0},
+	{"handover-socket", required_argument, 0, 0},
 	{0, 0, 0, 0},
 };
 
@@ -671,8 +1954,9 @@ int main(int argc, char **argv)
 	guint reg_id;
 	int c;
 	struct tcmulib_context *tcmulib_context;
+	int handover_sock = -1;
 	darray(struct tcmulib_handler) handlers = darray_new();
-	struct tcmur_handler **tmp_r_handler;
+	struct runner_handler *rh;
 
 	while (1) {
 		int option_index = 0;
@@ -686,9 +1970,32 @@ int main(int argc, char **argv)
 		case 0:
 			if (option_index == 1)
 				handler_path = strdup(optarg);
+			else if (option_index == 4)
+				notify_batch = strtoul(optarg, NULL, 0);
+			else if (option_index == 5)
+				notify_delay_us = strtoul(optarg, NULL, 0);
+			else if (option_index == 6)
+				busy_poll_us = strtoul(optarg, NULL, 0);
+			else if (option_index == 7)
+				nr_workers = strtoul(optarg, NULL, 0);
+			else if (option_index == 8) {
+#ifdef HAVE_IO_URING
+				use_io_uring = true;
+#else
+				errp("tcmu-runner was built without io_uring support\n");
+				exit(1);
+#endif
+			} else if (option_index == 9)
+				nr_loops = strtol(optarg, NULL, 0);
+			else if (option_index == 10)
+				trace_size = strtoul(optarg, NULL, 0);
+			else if (option_index == 11)
+				metrics_path = strdup(optarg);
+			else if (option_index == 12)
+				handover_path = strdup(optarg);
 			break;
 		case 'd':
-			debug = true;
+			tcmur_debug = true;
 			break;
 		case 'V':
 			printf("tcmu-runner %d.%d.%d\n",
@@ -718,41 +2025,98 @@ int main(int argc, char **argv)
 	}
 	dbgp("%d runner handlers found\n", ret);
 
+	/*
+	 * io_uring and busy polling work on one device per thread, so
+	 * they keep to that.
+	 */
+	if (use_io_uring || busy_poll_us) {
+		if (nr_loops > 0)
+			errp("--loop-threads ignored, --io-uring and --busy-poll-us give each device its own thread\n");
+		nr_loops = 0;
+	} else if (nr_loops < 0) {
+		nr_loops = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_loops < 1)
+			nr_loops = 1;
+	}
+
+	if (nr_loops) {
+		ret = start_loops();
+		if (ret) {
+			errp("couldn't start event loops: %d\n", ret);
+			exit(1);
+		}
+	}
+
 	/*
 	 * Convert from tcmu-runner's handler struct to libtcmu's
 	 * handler struct, an array of which we pass in, below.
 	 */
-	darray_foreach(tmp_r_handler, g_runner_handlers) {
+	darray_foreach(rh, g_runner_handlers) {
 		struct tcmulib_handler tmp_handler;
 
-		tmp_handler.name = (*tmp_r_handler)->name;
-		tmp_handler.subtype = (*tmp_r_handler)->subtype;
-		tmp_handler.cfg_desc = (*tmp_r_handler)->cfg_desc;
-		tmp_handler.check_config = (*tmp_r_handler)->check_config;
+		tmp_handler.name = rh->handler->name;
+		tmp_handler.subtype = rh->handler->subtype;
+		tmp_handler.cfg_desc = rh->handler->cfg_desc;
+		tmp_handler.check_config = rh->handler->check_config;
 		tmp_handler.added = dev_added;
 		tmp_handler.removed = dev_removed;
+		tmp_handler.parallel_added = rh->version >= 1 &&
+			rh->handler->parallel_open;
 
 		/*
 		 * Can hand out a ref to an internal pointer to the
 		 * darray b/c handlers will never be added or removed
 		 * once open_handlers() is done.
 		 */
-		tmp_handler.hm_private = *tmp_r_handler;
+		tmp_handler.hm_private = rh->handler;
 
 		darray_append(handlers, tmp_handler);
 	}
 
 
-	tcmulib_context = tcmulib_initialize(handlers.item, handlers.size, errp);
+	/*
+	 * The old runner stops adding devices once we're connected, and
+	 * gives each one up as we come to open it.
+	 */
+	if (handover_path) {
+		handover_sock = tcmur_handover_connect(handover_path);
+		if (handover_sock < 0 && handover_sock != -ENOENT) {
+			errp("couldn't take devices over from the running tcmu-runner: %d\n",
+			     handover_sock);
+			exit(1);
+		}
+	}
+
+	tcmulib_context = tcmulib_initialize_handover(handlers.item, handlers.size,
+						      errp, handover_sock >= 0 ?
+						      tcmur_handover_claim : NULL,
+						      GINT_TO_POINTER(handover_sock));
+	/* Hanging up without saying we're done leaves the old runner be */
 	if (!tcmulib_context) {
 		errp("tcmulib_initialize failed\n");
 		exit(1);
 	}
+	if (handover_sock >= 0)
+		tcmur_handover_done(handover_sock);
 
-	ret = sigaction(SIGINT, &tcmu_sigaction, NULL);
-	if (ret) {
-		errp("couldn't set sigaction\n");
-		exit(1);
+	g_unix_signal_add(SIGINT, handle_sigint, NULL);
+	g_unix_signal_add(SIGUSR1, dump_stats, NULL);
+
+	if (metrics_path) {
+		ret = tcmur_metrics_start(metrics_path, collect_metrics);
+		if (ret) {
+			errp("couldn't serve metrics on %s: %d\n", metrics_path, ret);
+			exit(1);
+		}
+	}
+
+	if (handover_path) {
+		ret = tcmur_handover_listen(handover_path, handover_devices);
+		if (ret) {
+			errp("couldn't listen for a new runner on %s: %d\n",
+			     handover_path, ret);
+			exit(1);
+		}
 	}
 
 	/* Set up event for libtcmu */
@@ -72,6 +72,7 @@
 #include "scsi_defs.h"
 #include "qcow.h"
 #include "qcow2.h"
+#include "tcmu-probes.h"
 
 #define min(a,b) ({ \
   __typeof__ (a) _a = (a); \
@@ -747,6 +748,7 @@ static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
 		}
 	}
 	/* not found, evict least used entry */
+	TCMU_PROBE1(qcow_l2_miss, l2_offset);
 	for (i = 0; i < L2_CACHE_SIZE; i++) {
 		if (s->l2_cache_counts[i] < min_count) {
 			min_count = s->l2_cache_counts[i];
@@ -765,8 +767,12 @@ static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
 
 static uint64_t qcow_cluster_alloc(struct qcow_state *s)
 {
+	uint64_t offset;
+
 	dbgp("%s\n", __func__);
-	return s->block_alloc(s, s->cluster_size);
+	offset = s->block_alloc(s, s->cluster_size);
+	TCMU_PROBE2(qcow_alloc, offset, s->cluster_size);
+	return offset;
 }
 
 /* qcow 1 simply grows the file as new clusters or L2 blocks are needed */
@@ -786,8 +792,12 @@ static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size)
 
 static uint64_t l2_table_alloc(struct qcow_state *s)
 {
+	uint64_t offset;
+
 	dbgp("%s\n", __func__);
-	return s->block_alloc(s, s->l2_size * sizeof(uint64_t));
+	offset = s->block_alloc(s, s->l2_size * sizeof(uint64_t));
+	TCMU_PROBE2(qcow_alloc, offset, s->l2_size * sizeof(uint64_t));
+	return offset;
 }
 
 static int l1_table_update(struct qcow_state *s, unsigned int l1_index, uint64_t l2_offset)
@@ -1162,6 +1172,7 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 			goto fail;
 		if (pwrite(s->fd, cow_buffer, s->cluster_size, cluster_offset) != s->cluster_size)
 			goto fail;
+		TCMU_PROBE2(qcow_cow, old_offset, cluster_offset);
 		free(cow_buffer);
 		l2_table_update(s, l2_table, l2_offset, l2_index, cluster_offset | s->cluster_copied);
 		s->set_refcount(s, cluster_offset, 1);
@@ -1481,7 +1492,7 @@ static int qcow_handle_cmd(
 	uint8_t cmd;
 	ssize_t ret;
 
-	cmd = cdb[0];
+	cmd = tcmulib_cmd->opcode;
 
 	switch (cmd) {
 	case INQUIRY:
@@ -1510,9 +1521,9 @@ static int qcow_handle_cmd(
 	case READ_12:
 	case READ_16:
 	{
-		uint64_t offset = bdev->block_size * tcmu_get_lba(cdb);
-		size_t length = tcmu_get_xfer_length(cdb) * bdev->block_size;
-		assert(tcmu_iovec_length(iovec, iov_cnt) == length);
+		uint64_t offset = bdev->block_size * tcmulib_cmd->lba;
+		size_t length = tcmulib_cmd->xfer_len * bdev->block_size;
+		assert(tcmulib_cmd->data_len == length);
 		size_t remaining = length;
 		while (remaining) {
 			ret = bdev->ops->preadv(bdev, iovec, iov_cnt, offset);
@@ -1531,9 +1542,9 @@ static int qcow_handle_cmd(
 	case WRITE_12:
 	case WRITE_16:
 	{
-		uint64_t offset = bdev->block_size * tcmu_get_lba(cdb);
-		size_t length = tcmu_get_xfer_length(cdb) * bdev->block_size;
-		assert(tcmu_iovec_length(iovec, iov_cnt) == length);
+		uint64_t offset = bdev->block_size * tcmulib_cmd->lba;
+		size_t length = tcmulib_cmd->xfer_len * bdev->block_size;
+		assert(tcmulib_cmd->data_len == length);
 		size_t remaining = length;
 		while (remaining) {
 			ret = bdev->ops->pwritev(bdev, iovec, iov_cnt, offset);
@@ -0,0 +1,369 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Microbenchmarks for the per-command helpers in api.c.
+ *
+ * The iovec helpers are run over transfers of 512 bytes to 1 MiB split
+ * into 1 to 256 segments, either evenly on 512 byte boundaries or
+ * unevenly at odd offsets. Most of them consume the iovec they're given,
+ * so each run starts from a fresh copy; the time that takes is measured
+ * on its own and taken off.
+ *
+ * bytes/cycle is against the x86 TSC, so it's reference cycles rather
+ * than core cycles; elsewhere only ns are reported.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <endian.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <scsi/scsi.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "libtcmu_common.h"
+#include "scsi_defs.h"
+
+#define MAX_SEGS	256
+#define MAX_XFER	(1 << 20)
+
+enum split {
+	SPLIT_ALIGNED,
+	SPLIT_UNALIGNED,
+};
+
+struct shape {
+	int nr_segs;
+	size_t len;
+	enum split split;
+	struct iovec iov[MAX_SEGS];	/* template, copied before each run */
+};
+
+struct helper {
+	const char *name;
+	bool consumes;	/* needs a fresh iovec each run */
+	void (*run)(struct shape *shape, struct iovec *iov);
+};
+
+static unsigned int min_ms = 100;
+static const char *filter;
+
+static uint8_t *data_area;	/* what the iovecs point into */
+static uint8_t *flat;		/* a flat copy of the same data */
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ticks(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Split shape->len over nr_segs segments. Unaligned splits vary the
+ * segment lengths and start the data at an odd address, like a
+ * transfer that begins partway into a buffer.
+ */
+static void build_shape(struct shape *shape, int nr_segs, size_t len,
+			enum split split)
+{
+	uint8_t *base = data_area + (split == SPLIT_UNALIGNED ? 3 : 0);
+	size_t left = len;
+	size_t seg_len;
+	int i;
+
+	shape->nr_segs = nr_segs;
+	shape->len = len;
+	shape->split = split;
+
+	for (i = 0; i < nr_segs; i++) {
+		seg_len = left / (nr_segs - i);
+		if (split == SPLIT_ALIGNED)
+			seg_len &= ~511UL;
+		else if (i < nr_segs - 1 && seg_len > 2)
+			seg_len += (i & 1) ? -(seg_len / 3) : seg_len / 3;
+		if (!seg_len || i == nr_segs - 1)
+			seg_len = left;
+
+		shape->iov[i].iov_base = base;
+		shape->iov[i].iov_len = seg_len;
+
+		/* Leave a gap, the segments aren't one buffer */
+		base += seg_len + 64;
+		left -= seg_len;
+	}
+}
+
+static void run_into(struct shape *shape, struct iovec *iov)
+{
+	sink += tcmu_memcpy_into_iovec(iov, shape->nr_segs, flat, shape->len);
+}
+
+static void run_from(struct shape *shape, struct iovec *iov)
+{
+	sink += tcmu_memcpy_from_iovec(flat, shape->len, iov, shape->nr_segs);
+}
+
+static void run_compare(struct shape *shape, struct iovec *iov)
+{
+	sink += tcmu_compare_with_iovec(flat, iov, shape->len);
+}
+
+static void run_seek(struct shape *shape, struct iovec *iov)
+{
+	tcmu_seek_in_iovec(iov, shape->len - 1);
+	sink += iov[shape->nr_segs - 1].iov_len;
+}
+
+static void run_length(struct shape *shape, struct iovec *iov)
+{
+	sink += tcmu_iovec_length(iov, shape->nr_segs);
+}
+
+static void run_reset(struct shape *shape, struct iovec *iov)
+{
+}
+
+static struct helper helpers[] = {
+	{ "memcpy_into_iovec", true, run_into },
+	{ "memcpy_from_iovec", true, run_from },
+	{ "compare_with_iovec", false, run_compare },
+	{ "seek_in_iovec", true, run_seek },
+	{ "iovec_length", false, run_length },
+};
+
+static struct helper reset_helper = { "reset", true, run_reset };
+
+/* Average ns and TSC ticks per run, over at least min_ms */
+static void time_helper(struct helper *helper, struct shape *shape,
+			double *ns, double *ticks)
+{
+	struct iovec iov[MAX_SEGS];
+	uint64_t start, start_ticks, elapsed;
+	uint64_t iters = 0, batch = 16;
+	uint64_t i;
+
+	memcpy(iov, shape->iov, shape->nr_segs * sizeof(*iov));
+
+	start = now_ns();
+	start_ticks = now_ticks();
+	do {
+		for (i = 0; i < batch; i++) {
+			if (helper->consumes)
+				memcpy(iov, shape->iov, shape->nr_segs * sizeof(*iov));
+			helper->run(shape, iov);
+		}
+		iters += batch;
+		batch *= 2;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ms * 1000000ULL);
+
+	*ns = (double) elapsed / iters;
+	*ticks = (double) (now_ticks() - start_ticks) / iters;
+}
+
+static void bench_iovec_helpers(void)
+{
+	static const int seg_counts[] = { 1, 4, 16, 64, 256 };
+	static const size_t lens[] = { 512, 4096, 65536, MAX_XFER };
+	static struct shape shape;
+	double reset_ns, reset_ticks, ns, ticks;
+	int h, s, l, split;
+
+	printf("%-20s %5s %8s %-9s %12s %12s\n",
+	       "helper", "segs", "bytes", "split", "ns/op", "bytes/cycle");
+
+	for (h = 0; h < sizeof(helpers) / sizeof(helpers[0]); h++) {
+		if (filter && !strstr(helpers[h].name, filter))
+			continue;
+
+		for (s = 0; s < sizeof(seg_counts) / sizeof(seg_counts[0]); s++) {
+			for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+				for (split = SPLIT_ALIGNED; split <= SPLIT_UNALIGNED; split++) {
+					/* Aligned splits need a sector per segment */
+					if (split == SPLIT_ALIGNED &&
+					    lens[l] < seg_counts[s] * 512)
+						continue;
+					if (lens[l] < seg_counts[s])
+						continue;
+
+					build_shape(&shape, seg_counts[s], lens[l], split);
+
+					reset_ns = reset_ticks = 0;
+					if (helpers[h].consumes)
+						time_helper(&reset_helper, &shape,
+							    &reset_ns, &reset_ticks);
+					time_helper(&helpers[h], &shape, &ns, &ticks);
+					ns -= reset_ns;
+					ticks -= reset_ticks;
+
+					printf("%-20s %5d %8zu %-9s %12.1f ",
+					       helpers[h].name, shape.nr_segs, shape.len,
+					       split == SPLIT_ALIGNED ? "aligned" : "unaligned",
+					       ns);
+#ifdef HAVE_TSC
+					printf("%12.2f\n", ticks > 0 ? shape.len / ticks : 0);
+#else
+					printf("%12s\n", "-");
+#endif
+				}
+			}
+		}
+	}
+}
+
+/* READ CDBs of each length, for the CDB decoders */
+static void build_cdbs(uint8_t cdbs[4][16])
+{
+	memset(cdbs, 0, 4 * 16);
+
+	cdbs[0][0] = READ_6;
+	cdbs[0][3] = 0x10;
+	cdbs[0][4] = 8;
+
+	cdbs[1][0] = READ_10;
+	*(uint32_t *) &cdbs[1][2] = htobe32(0x12345678);
+	*(uint16_t *) &cdbs[1][7] = htobe16(8);
+
+	cdbs[2][0] = READ_12;
+	*(uint32_t *) &cdbs[2][2] = htobe32(0x12345678);
+	*(uint32_t *) &cdbs[2][6] = htobe32(8);
+
+	cdbs[3][0] = READ_16;
+	*(uint64_t *) &cdbs[3][2] = htobe64(0x123456789aULL);
+	*(uint32_t *) &cdbs[3][10] = htobe32(8);
+}
+
+static void bench_cdb_helpers(void)
+{
+	static const char *names[] = { "6", "10", "12", "16" };
+	uint8_t cdbs[4][16];
+	uint64_t start, elapsed, iters;
+	int c, i;
+
+	build_cdbs(cdbs);
+
+	printf("\n%-20s %5s %12s\n", "helper", "cdb", "ns/op");
+
+	for (i = 0; i < 2; i++) {
+		const char *name = i ? "get_xfer_length" : "get_lba";
+
+		if (filter && !strstr(name, filter))
+			continue;
+
+		for (c = 0; c < 4; c++) {
+			iters = 0;
+			start = now_ns();
+			do {
+				int n;
+
+				/* Keep the loop overhead small next to the call */
+				for (n = 0; n < 1024; n++) {
+					if (i)
+						sink += tcmu_get_xfer_length(cdbs[c]);
+					else
+						sink += tcmu_get_lba(cdbs[c]);
+				}
+				iters += 1024;
+				elapsed = now_ns() - start;
+			} while (elapsed < min_ms * 1000000ULL);
+
+			printf("%-20s %5s %12.2f\n", name, names[c],
+			       (double) elapsed / iters);
+		}
+	}
+}
+
+static void usage(void)
+{
+	printf("\nusage:\n");
+	printf("\ttcmu-api-bench [options]\n");
+	printf("\noptions:\n");
+	printf("\t-h, --help: print this message and exit\n");
+	printf("\t-t, --time-ms: least time spent on each case, default 100\n");
+	printf("\t-f, --filter: only run helpers whose name contains this\n");
+	printf("\n");
+}
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 'h'},
+	{"time-ms", required_argument, 0, 't'},
+	{"filter", required_argument, 0, 'f'},
+	{0, 0, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+	size_t area_len;
+	int c;
+
+	while (1) {
+		int option_index = 0;
+
+		c = getopt_long(argc, argv, "ht:f:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			min_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+		case 'h':
+			usage();
+			exit(1);
+		}
+	}
+
+	/* Data plus the gaps between segments and the unaligned offset */
+	area_len = MAX_XFER + (MAX_SEGS + 1) * 64;
+	data_area = aligned_alloc(4096, area_len);
+	flat = aligned_alloc(4096, MAX_XFER);
+	if (!data_area || !flat) {
+		fprintf(stderr, "ENOMEM\n");
+		exit(1);
+	}
+	/* Same bytes on both sides, so compares run to the end */
+	memset(data_area, 0x5a, area_len);
+	memset(flat, 0x5a, MAX_XFER);
+
+	bench_iovec_helpers();
+	bench_cdb_helpers();
+
+	free(flat);
+	free(data_area);
+	return 0;
+}
@@ -0,0 +1,368 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Benchmark a tcmu-runner handler, and libtcmu's ring path under it,
+ * against the in-process simulator in tcmu-sim.c instead of the kernel.
+ *
+ * The device thread works like tcmu-runner's with a thread per device,
+ * and runs commands through the handler with the same code and handler
+ * registry (tcmu-dispatch.c): it takes bursts of commands off the ring
+ * and runs them through the handler, or queues them for --workers.
+ * The simulator, on the main thread, keeps the ring at the given queue
+ * depth and times each command from queueing to reaping.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "darray.h"
+#include "tcmu-runner.h"
+#include "libtcmu.h"
+#include "libtcmu_priv.h"
+#include "tcmu-sim.h"
+#include "tcmu-dispatch.h"
+
+static bool stopping;
+static unsigned int nr_workers;
+
+/* The one device's */
+static struct tcmur_dispatch g_dispatch;
+
+struct tcmur_dispatch *tcmur_get_dispatch(struct tcmu_device *dev)
+{
+	return tcmulib_get_dev_data(dev);
+}
+
+/* As tcmu-runner's dev_added() */
+static int bench_added(struct tcmu_device *dev)
+{
+	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
+	struct tcmur_handler *r_handler = handler->hm_private;
+	struct tcmur_dispatch *d = &g_dispatch;
+	int ret;
+
+	tcmur_dispatch_init(d, r_handler);
+	tcmulib_set_dev_data(dev, d);
+
+	ret = r_handler->open(dev);
+	if (ret)
+		return ret;
+
+	ret = tcmur_dispatch_start(dev, d, nr_workers);
+	if (ret)
+		r_handler->close(dev);
+	return ret;
+}
+
+static void bench_removed(struct tcmu_device *dev)
+{
+	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
+	struct tcmur_handler *r_handler = handler->hm_private;
+	struct tcmur_dispatch *d = &g_dispatch;
+
+	tcmur_dispatch_stop(dev, d);
+
+	r_handler->close(dev);
+}
+
+static void *dev_thread(void *arg)
+{
+	struct tcmu_device *dev = arg;
+	struct tcmur_dispatch *d = &g_dispatch;
+	struct tcmulib_cmd *cmds[TCMUR_CMD_BURST];
+	struct pollfd pfd;
+	struct timespec ts;
+	int completed;
+	int nr_cmds;
+	int timeout;
+
+	pfd.fd = tcmu_get_dev_fd(dev);
+	pfd.events = POLLIN;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		completed = 0;
+
+		tcmulib_processing_start(dev);
+
+		while ((nr_cmds = tcmulib_get_next_commands(dev, cmds, TCMUR_CMD_BURST)) > 0) {
+			if (d->wq)
+				tcmur_queue_commands(d->wq, dev, cmds, NULL, nr_cmds);
+			else
+				completed += tcmur_handle_commands(dev, cmds, NULL, nr_cmds);
+		}
+
+		if (completed)
+			tcmulib_processing_complete(dev);
+
+		timeout = tcmulib_get_notify_timeout(dev);
+		while (timeout >= 0) {
+			ts.tv_sec = timeout / 1000000;
+			ts.tv_nsec = (timeout % 1000000) * 1000;
+			if (ppoll(&pfd, 1, &ts, NULL) != 0)
+				break;
+			tcmulib_processing_complete(dev);
+			timeout = tcmulib_get_notify_timeout(dev);
+		}
+		if (timeout < 0)
+			poll(&pfd, 1, -1);
+	}
+
+	return NULL;
+}
+
+static uint64_t rusage_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void report(struct tcmu_sim_config *cfg, unsigned int duration,
+		   struct tcmu_sim_stats *stats, uint64_t cpu_ns)
+{
+	uint64_t ops = stats->reads + stats->writes;
+	double secs = stats->elapsed_ns / 1e9;
+
+	if (!ops)
+		return;
+
+	printf("qd %u, %u byte I/Os, %u%% reads, %u s\n",
+	       cfg->queue_depth, cfg->io_size, cfg->read_pct, duration);
+	printf("ops: %llu (%llu reads, %llu writes), %llu errors\n",
+	       (unsigned long long) ops,
+	       (unsigned long long) stats->reads,
+	       (unsigned long long) stats->writes,
+	       (unsigned long long) stats->errors);
+	printf("iops: %.0f, %.1f MiB/s\n", ops / secs,
+	       ops * (double) cfg->io_size / secs / (1 << 20));
+	printf("latency us: min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+	       stats->lat_min_ns / 1e3,
+	       tcmu_sim_percentile(stats, 50) / 1e3,
+	       tcmu_sim_percentile(stats, 90) / 1e3,
+	       tcmu_sim_percentile(stats, 99) / 1e3,
+	       tcmu_sim_percentile(stats, 99.9) / 1e3,
+	       stats->lat_max_ns / 1e3);
+	printf("cpu us/op: %.2f (%.2f without the simulator)\n",
+	       cpu_ns / 1e3 / ops,
+	       (cpu_ns - stats->cpu_ns) / 1e3 / ops);
+}
+
+static void usage(void)
+{
+	printf("\nusage:\n");
+	printf("\ttcmu-bench [options] -H <handler.so> -c <cfgstring>\n");
+	printf("\noptions:\n");
+	printf("\t-h, --help: print this message and exit\n");
+	printf("\t-d, --debug: enable debug messages\n");
+	printf("\t-H, --handler: handler module to load\n");
+	printf("\t-c, --cfgstring: device config, e.g. file//tmp/disk.img\n");
+	printf("\t-q, --queue-depth: commands kept in flight, default 32\n");
+	printf("\t-b, --io-size: bytes per command, default 4096\n");
+	printf("\t-r, --read-pct: share of reads, default 100\n");
+	printf("\t-s, --size: device size in MiB, default 1024\n");
+	printf("\t-B, --block-size: device block size, default 512\n");
+	printf("\t-t, --time: seconds to run, default 10\n");
+	printf("\t--notify-batch: completions to coalesce per doorbell\n");
+	printf("\t--notify-delay-us: longest a coalesced doorbell is held back\n");
+	printf("\t--workers: threads running the device's commands, for handlers\n");
+	printf("\t\tthat allow it. default is 0 (run on the device thread)\n");
+	printf("\n");
+}
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 'h'},
+	{"debug", no_argument, 0, 'd'},
+	{"handler", required_argument, 0, 'H'},
+	{"cfgstring", required_argument, 0, 'c'},
+	{"queue-depth", required_argument, 0, 'q'},
+	{"io-size", required_argument, 0, 'b'},
+	{"read-pct", required_argument, 0, 'r'},
+	{"size", required_argument, 0, 's'},
+	{"block-size", required_argument, 0, 'B'},
+	{"time", required_argument, 0, 't'},
+	{"notify-batch", required_argument, 0, 0},
+	{"notify-delay-us", required_argument, 0, 0},
+	{"workers", required_argument, 0, 0},
+	{0, 0, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+	struct tcmu_sim_config cfg = {
+		.queue_depth = 32,
+		.io_size = 4096,
+		.read_pct = 100,
+		.block_size = 512,
+		.dev_size = 1024LL << 20,
+	};
+	darray(struct tcmulib_handler) handlers = darray_new();
+	struct runner_handler *rh;
+	struct tcmulib_context *ctx;
+	struct tcmu_sim_stats stats;
+	struct tcmu_device *dev;
+	struct tcmu_sim *sim;
+	char *handler_path = NULL;
+	char *cfgstring = NULL;
+	char *dev_cfgstring;
+	unsigned int duration = 10;
+	unsigned int notify_batch = 0;
+	unsigned int notify_delay_us = 50;
+	pthread_t thread;
+	uint64_t cpu_ns;
+	size_t map_len;
+	void *map;
+	int ret = 1;
+	int c;
+
+	while (1) {
+		int option_index = 0;
+
+		c = getopt_long(argc, argv, "hdH:c:q:b:r:s:B:t:",
+				long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 0:
+			if (option_index == 10)
+				notify_batch = strtoul(optarg, NULL, 0);
+			else if (option_index == 11)
+				notify_delay_us = strtoul(optarg, NULL, 0);
+			else if (option_index == 12)
+				nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			tcmur_debug = true;
+			break;
+		case 'H':
+			handler_path = optarg;
+			break;
+		case 'c':
+			cfgstring = optarg;
+			break;
+		case 'q':
+			cfg.queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.read_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.dev_size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'B':
+			cfg.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		default:
+		case 'h':
+			usage();
+			exit(1);
+		}
+	}
+
+	if (!handler_path || !cfgstring) {
+		usage();
+		exit(1);
+	}
+
+	if (tcmur_open_handler(handler_path))
+		exit(1);
+
+	darray_foreach(rh, g_runner_handlers) {
+		struct tcmulib_handler tmp_handler = {
+			.name = rh->handler->name,
+			.subtype = rh->handler->subtype,
+			.cfg_desc = rh->handler->cfg_desc,
+			.check_config = rh->handler->check_config,
+			.added = bench_added,
+			.removed = bench_removed,
+			.hm_private = rh->handler,
+		};
+
+		darray_append(handlers, tmp_handler);
+	}
+
+	sim = tcmu_sim_create(&cfg);
+	if (!sim) {
+		errp("invalid benchmark parameters\n");
+		exit(1);
+	}
+
+	ctx = tcmu_sim_initialize(handlers.item, handlers.size, errp);
+	if (!ctx) {
+		errp("could not set up libtcmu\n");
+		goto err_sim;
+	}
+
+	/* Looks like one from the kernel, tcm-user/<hba>/<dev>/<cfgstring> */
+	if (asprintf(&dev_cfgstring, "tcm-user/0/bench/%s", cfgstring) == -1) {
+		errp("ENOMEM\n");
+		goto err_ctx;
+	}
+
+	map = tcmu_sim_get_map(sim, &map_len);
+	dev = tcmu_sim_add_device(ctx, "uio0", dev_cfgstring,
+				  tcmu_sim_get_fd(sim), map, map_len,
+				  cfg.block_size, cfg.dev_size);
+	free(dev_cfgstring);
+	if (!dev) {
+		errp("could not add device for %s\n", cfgstring);
+		goto err_ctx;
+	}
+
+	tcmulib_set_notify_coalescing(dev, notify_batch, notify_delay_us);
+
+	if (pthread_create(&thread, NULL, dev_thread, dev)) {
+		errp("could not start device thread\n");
+		goto err_dev;
+	}
+
+	cpu_ns = rusage_ns();
+	ret = tcmu_sim_run(sim, duration * 1000, &stats) ? 1 : 0;
+	cpu_ns = rusage_ns() - cpu_ns;
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	tcmu_sim_kick(sim);
+	pthread_join(thread, NULL);
+
+	report(&cfg, duration, &stats, cpu_ns);
+	if (stats.errors)
+		ret = 1;
+
+err_dev:
+	tcmu_sim_remove_device(dev);
+err_ctx:
+	tcmu_sim_close(ctx);
+err_sim:
+	tcmu_sim_destroy(sim);
+	darray_free(handlers);
+	return ret;
+}
@@ -0,0 +1,673 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "darray.h"
+#include "tcmu-runner.h"
+#include "libtcmu.h"
+#include "tcmu-dispatch.h"
+#include "tcmu-probes.h"
+#ifdef HAVE_IO_URING
+#include "tcmu-uring.h"
+#endif
+
+/* Max commands a worker takes off the queue at once */
+#define TCMUR_WORKER_BATCH 8
+
+struct tcmu_work {
+	struct tcmu_device *dev;
+	struct tcmulib_cmd *cmd;
+	tcmur_work_fn fn;	/* NULL to run the command through handle_cmd */
+};
+
+typedef darray(struct tcmu_device *) darray_dev;
+
+struct tcmu_worker {
+	struct tcmu_work_queue *wq;
+	pthread_t thread;
+	struct tcmu_device *dev;	/* whose commands it's running, or NULL */
+};
+
+/*
+ * With --workers, device threads and loops only take commands off the
+ * rings and queue them here; the workers run them through the handler
+ * and complete them. Work handlers pass to tcmur_submit_work() goes
+ * through a queue of its own, with its own workers. Either is shared
+ * by all the devices that want the same, see tcmur_get_workers().
+ */
+struct tcmu_work_queue {
+	const void *key;
+	int refs;		/* under g_queues_lock */
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;	/* commands were queued, or stop */
+	pthread_cond_t space_cond;	/* commands were taken off */
+	pthread_cond_t idle_cond;	/* a worker is done, if flushing */
+	unsigned int head;
+	unsigned int tail;
+	unsigned int len;
+	bool stop;
+	struct tcmu_work *works;
+	tcmur_room_fn room_fn;	/* to call once there's room, see tcmur_queue_room() */
+	darray_dev waiting;	/* for room_fn */
+	int kicking;		/* room_fn calls running */
+	int flushing;		/* in tcmur_flush_workers() */
+
+	int nr_workers;
+	struct tcmu_worker *workers;
+};
+
+static darray(struct tcmu_work_queue *) g_queues = darray_new();
+static pthread_mutex_t g_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Set while a thread is in tcmur_handle_commands(), which then counts
+ * commands tcmur_cmd_complete() completed inline, so they're passed on to
+ * the kernel along with the rest of the batch.
+ */
+static __thread bool in_handle_commands;
+static __thread int inline_completions;
+
+bool tcmur_debug;
+darray_runner_handler g_runner_handlers = darray_new();
+
+/*
+ * Debug API implementation
+ */
+void dbgp(const char *fmt, ...)
+{
+	if (tcmur_debug) {
+		va_list va;
+		va_start(va, fmt);
+		vprintf(fmt, va);
+		va_end(va);
+	}
+}
+
+void errp(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+void tcmur_register_handler_version(struct tcmur_handler *handler,
+				    unsigned int version)
+{
+	struct runner_handler rh = { .handler = handler, .version = version };
+
+	/* Whatever it has on top of what we know about goes unused */
+	if (version > TCMUR_HANDLER_VERSION) {
+		dbgp("%s: handler is version %u, using version %d of it\n",
+		     handler->subtype, version, TCMUR_HANDLER_VERSION);
+		rh.version = TCMUR_HANDLER_VERSION;
+	}
+
+	darray_append(g_runner_handlers, rh);
+}
+
+void tcmur_register_handler(struct tcmur_handler *handler)
+{
+	tcmur_register_handler_version(handler, 0);
+}
+
+bool tcmur_unregister_handler(struct tcmur_handler *handler)
+{
+	int i;
+	for (i = 0; i < darray_size(g_runner_handlers); i++) {
+		if (darray_item(g_runner_handlers, i).handler == handler) {
+			darray_remove(g_runner_handlers, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned int tcmur_handler_version(struct tcmur_handler *handler)
+{
+	struct runner_handler *rh;
+
+	darray_foreach(rh, g_runner_handlers) {
+		if (rh->handler == handler)
+			return rh->version;
+	}
+	return 0;
+}
+
+int tcmur_open_handler(const char *path)
+{
+	void (*handler_init)(void);
+	void *handle;
+
+	handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+	if (!handle) {
+		errp("Could not open handler at %s: %s\n", path, dlerror());
+		return -1;
+	}
+
+	handler_init = dlsym(handle, "handler_init");
+	if (!handler_init) {
+		errp("dlsym failure on %s\n", path);
+		return -1;
+	}
+
+	handler_init();
+
+	return 0;
+}
+
+void tcmur_dispatch_init(struct tcmur_dispatch *d, struct tcmur_handler *handler)
+{
+	d->handler_version = tcmur_handler_version(handler);
+	if (d->handler_version >= 1) {
+		d->nr_async_threads = handler->nr_async_threads;
+		d->async_queue_len = handler->async_queue_len;
+	}
+}
+
+int tcmur_dispatch_start(struct tcmu_device *dev, struct tcmur_dispatch *d,
+			 unsigned int nr_workers)
+{
+	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
+	struct tcmur_handler *r_handler = handler->hm_private;
+
+	if (nr_workers && (d->handler_version < 1 ||
+			   !r_handler->multi_threaded)) {
+		dbgp("%s: handler is single threaded, not using workers\n",
+		     tcmu_get_dev_cfgstring(dev));
+	} else if (nr_workers) {
+		d->wq = tcmur_get_workers(NULL, nr_workers, TCMUR_WORK_QUEUE_LEN);
+		if (!d->wq)
+			return -ENOMEM;
+	}
+
+	/* Shared by the handler's devices with the same limits */
+	if (d->nr_async_threads) {
+		d->async_wq = tcmur_get_workers(r_handler, d->nr_async_threads,
+						d->async_queue_len ?:
+						TCMUR_ASYNC_QUEUE_LEN);
+		if (!d->async_wq) {
+			if (d->wq) {
+				tcmur_put_workers(d->wq);
+				d->wq = NULL;
+			}
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void tcmur_dispatch_stop(struct tcmu_device *dev, struct tcmur_dispatch *d)
+{
+	if (d->wq) {
+		tcmur_flush_workers(d->wq, dev);
+		tcmur_put_workers(d->wq);
+		d->wq = NULL;
+	}
+
+	/* After the --workers, which may still have submitted work */
+	if (d->async_wq) {
+		tcmur_flush_workers(d->async_wq, dev);
+		tcmur_put_workers(d->async_wq);
+		d->async_wq = NULL;
+	}
+}
+
+static void stop_workers(struct tcmu_work_queue *wq)
+{
+	int i;
+
+	/* Workers drain what's already queued before they exit */
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->work_cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_workers; i++)
+		pthread_join(wq->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&wq->idle_cond);
+	pthread_cond_destroy(&wq->space_cond);
+	pthread_cond_destroy(&wq->work_cond);
+	pthread_mutex_destroy(&wq->lock);
+	darray_free(wq->waiting);
+	free(wq->workers);
+	free(wq->works);
+	free(wq);
+}
+
+/*
+ * Run commands through the handler, all at once if it has handle_cmds,
+ * or through the work function they were submitted with if fns is
+ * given, and complete the ones that were handled synchronously.
+ * Returns how many were completed.
+ */
+int tcmur_handle_commands(struct tcmu_device *dev, struct tcmulib_cmd **cmds,
+			  tcmur_work_fn *fns, int nr_cmds)
+{
+	struct tcmulib_handler *handler = tcmu_get_dev_handler(dev);
+	struct tcmur_handler *r_handler = handler->hm_private;
+	struct tcmulib_cmd *done[TCMUR_CMD_BURST];
+	int results[TCMUR_CMD_BURST];
+	bool batch = !fns && tcmur_get_dispatch(dev)->handler_version >= 1 &&
+		r_handler->handle_cmds;
+	int nr_done = 0;
+	int j;
+
+	in_handle_commands = true;
+
+	if (batch) {
+		for (j = 0; j < nr_cmds; j++)
+			TCMU_PROBE3(handler_entry, dev, cmds[j]->cmd_id,
+				    cmds[j]->opcode);
+		r_handler->handle_cmds(dev, cmds, results, nr_cmds);
+	}
+
+	/* Only ever moves results back, over ones already looked at */
+	for (j = 0; j < nr_cmds; j++) {
+		struct tcmulib_cmd *cmd = cmds[j];
+
+		if (!batch) {
+			TCMU_PROBE3(handler_entry, dev, cmd->cmd_id, cmd->opcode);
+			if (fns && fns[j])
+				results[j] = fns[j](dev, cmd);
+			else
+				results[j] = r_handler->handle_cmd(dev, cmd);
+		}
+		TCMU_PROBE3(handler_return, dev, cmd->cmd_id, results[j]);
+		if (results[j] != TCMU_ASYNC_HANDLED) {
+			done[nr_done] = cmd;
+			results[nr_done] = results[j];
+			nr_done++;
+		}
+	}
+
+	in_handle_commands = false;
+
+	if (nr_done)
+		tcmulib_commands_complete(dev, done, results, nr_done);
+
+	nr_done += inline_completions;
+	inline_completions = 0;
+
+	return nr_done;
+}
+
+void tcmur_cmd_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			int result)
+{
+	tcmulib_command_complete(dev, cmd, result);
+
+	if (in_handle_commands)
+		inline_completions++;
+	else
+		tcmulib_processing_complete(dev);
+}
+
+void tcmur_queue_io(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		    int op, int fd, off_t offset, tcmur_io_done_fn done)
+{
+	ssize_t ret;
+
+#ifdef HAVE_IO_URING
+	if (tcmur_uring_queue_io(dev, cmd, op, fd, offset, done))
+		return;
+#endif
+
+	if (cmd->flags & TCMULIB_CMD_CONTIGUOUS && cmd->iov_cnt) {
+		if (op == TCMUR_IO_READ)
+			ret = pread(fd, cmd->iovec[0].iov_base,
+				    cmd->iovec[0].iov_len, offset);
+		else
+			ret = pwrite(fd, cmd->iovec[0].iov_base,
+				     cmd->iovec[0].iov_len, offset);
+	} else if (op == TCMUR_IO_READ) {
+		ret = preadv(fd, cmd->iovec, cmd->iov_cnt, offset);
+	} else {
+		ret = pwritev(fd, cmd->iovec, cmd->iov_cnt, offset);
+	}
+	if (ret == -1)
+		ret = -errno;
+
+	tcmur_cmd_complete(dev, cmd, done(dev, cmd, ret));
+}
+
+static unsigned int room(struct tcmu_work_queue *wq)
+{
+	return wq->len - (wq->head - wq->tail);
+}
+
+/* Room worth waking whoever waits for it, so it isn't woken per slot */
+static unsigned int room_wanted(struct tcmu_work_queue *wq)
+{
+	unsigned int wanted = (wq->len + 1) / 2;
+
+	return wanted < TCMUR_CMD_BURST ? wanted : TCMUR_CMD_BURST;
+}
+
+static void *worker_start(void *arg)
+{
+	struct tcmu_worker *worker = arg;
+	struct tcmu_work_queue *wq = worker->wq;
+	struct tcmulib_cmd *cmds[TCMUR_WORKER_BATCH];
+	tcmur_work_fn fns[TCMUR_WORKER_BATCH];
+	darray_dev waiting = darray_new();
+	struct tcmu_device **waiter;
+	struct tcmu_device *dev;
+	tcmur_room_fn room_fn;
+	unsigned int queued;
+	bool has_fns;
+	int nr_cmds;
+
+	while (1) {
+		pthread_mutex_lock(&wq->lock);
+
+		/* Done with the last batch, and with waking its waiters */
+		worker->dev = NULL;
+		if (darray_size(waiting)) {
+			wq->kicking--;
+			darray_free(waiting);
+			darray_init(waiting);
+		}
+		if (wq->flushing)
+			pthread_cond_broadcast(&wq->idle_cond);
+
+		while (wq->head == wq->tail && !wq->stop)
+			pthread_cond_wait(&wq->work_cond, &wq->lock);
+
+		if (wq->head == wq->tail) {
+			pthread_mutex_unlock(&wq->lock);
+			break;
+		}
+
+		/* Take a fair share, so one worker doesn't serialize a burst */
+		queued = wq->head - wq->tail;
+		nr_cmds = (queued + wq->nr_workers - 1) / wq->nr_workers;
+		if (nr_cmds > TCMUR_WORKER_BATCH)
+			nr_cmds = TCMUR_WORKER_BATCH;
+		/* of one device's commands */
+		dev = wq->works[wq->tail % wq->len].dev;
+		has_fns = false;
+		for (queued = 0; queued < nr_cmds; queued++) {
+			struct tcmu_work *work = &wq->works[wq->tail % wq->len];
+
+			if (work->dev != dev)
+				break;
+			wq->tail++;
+			cmds[queued] = work->cmd;
+			fns[queued] = work->fn;
+			if (work->fn)
+				has_fns = true;
+		}
+		nr_cmds = queued;
+		worker->dev = dev;
+
+		pthread_cond_signal(&wq->space_cond);
+		room_fn = wq->room_fn;
+		if (darray_size(wq->waiting) && room(wq) >= room_wanted(wq)) {
+			waiting = wq->waiting;
+			darray_init(wq->waiting);
+			wq->kicking++;
+		}
+		pthread_mutex_unlock(&wq->lock);
+
+		darray_foreach(waiter, waiting)
+			room_fn(*waiter);
+
+		/*
+		 * Whatever completed in the batch goes to the kernel at
+		 * once. Plain commands can go to handle_cmds together.
+		 */
+		if (tcmur_handle_commands(dev, cmds, has_fns ? fns : NULL, nr_cmds))
+			tcmulib_processing_complete(dev);
+	}
+
+	return NULL;
+}
+
+static struct tcmu_work_queue *start_workers(int count, unsigned int len)
+{
+	struct tcmu_work_queue *wq;
+	int ret;
+
+	wq = calloc(1, sizeof(*wq));
+	if (!wq)
+		return NULL;
+
+	wq->workers = calloc(count, sizeof(*wq->workers));
+	wq->works = calloc(len, sizeof(*wq->works));
+	if (!wq->workers || !wq->works) {
+		free(wq->works);
+		free(wq->workers);
+		free(wq);
+		return NULL;
+	}
+
+	wq->len = len;
+	darray_init(wq->waiting);
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->work_cond, NULL);
+	pthread_cond_init(&wq->space_cond, NULL);
+	pthread_cond_init(&wq->idle_cond, NULL);
+
+	for (; wq->nr_workers < count; wq->nr_workers++) {
+		struct tcmu_worker *worker = &wq->workers[wq->nr_workers];
+
+		worker->wq = wq;
+		ret = pthread_create(&worker->thread, NULL, worker_start, worker);
+		if (ret) {
+			errp("couldn't start worker: %d\n", ret);
+			stop_workers(wq);
+			return NULL;
+		}
+	}
+
+	return wq;
+}
+
+struct tcmu_work_queue *tcmur_get_workers(const void *key, int count,
+					  unsigned int len)
+{
+	struct tcmu_work_queue **wqp, *wq = NULL;
+
+	pthread_mutex_lock(&g_queues_lock);
+
+	darray_foreach(wqp, g_queues) {
+		if ((*wqp)->key == key && (*wqp)->nr_workers == count &&
+		    (*wqp)->len == len) {
+			wq = *wqp;
+			break;
+		}
+	}
+
+	if (!wq) {
+		wq = start_workers(count, len);
+		if (wq) {
+			wq->key = key;
+			darray_append(g_queues, wq);
+		}
+	}
+	if (wq)
+		wq->refs++;
+
+	pthread_mutex_unlock(&g_queues_lock);
+
+	return wq;
+}
+
+void tcmur_put_workers(struct tcmu_work_queue *wq)
+{
+	int i;
+
+	pthread_mutex_lock(&g_queues_lock);
+	if (--wq->refs) {
+		pthread_mutex_unlock(&g_queues_lock);
+		return;
+	}
+
+	for (i = 0; i < darray_size(g_queues); i++) {
+		if (darray_item(g_queues, i) == wq) {
+			darray_remove(g_queues, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_queues_lock);
+
+	stop_workers(wq);
+}
+
+/* Whether any of the device's work is queued or running */
+static bool dev_busy(struct tcmu_work_queue *wq, struct tcmu_device *dev)
+{
+	unsigned int i;
+
+	/* Any of them may be waking it */
+	if (wq->kicking)
+		return true;
+
+	for (i = wq->tail; i != wq->head; i++) {
+		if (wq->works[i % wq->len].dev == dev)
+			return true;
+	}
+
+	for (i = 0; i < wq->nr_workers; i++) {
+		if (wq->workers[i].dev == dev)
+			return true;
+	}
+
+	return false;
+}
+
+void tcmur_flush_workers(struct tcmu_work_queue *wq, struct tcmu_device *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&wq->lock);
+
+	for (i = 0; i < darray_size(wq->waiting); i++) {
+		if (darray_item(wq->waiting, i) == dev) {
+			darray_remove(wq->waiting, i);
+			break;
+		}
+	}
+
+	wq->flushing++;
+	while (dev_busy(wq, dev))
+		pthread_cond_wait(&wq->idle_cond, &wq->lock);
+	wq->flushing--;
+
+	pthread_mutex_unlock(&wq->lock);
+}
+
+static void unlock_mutex(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+/* Waits for room if the queue is full */
+void tcmur_queue_commands(struct tcmu_work_queue *wq, struct tcmu_device *dev,
+			  struct tcmulib_cmd **cmds, tcmur_work_fn fn,
+			  int nr_cmds)
+{
+	int i;
+
+	pthread_mutex_lock(&wq->lock);
+	pthread_cleanup_push(unlock_mutex, &wq->lock);
+
+	for (i = 0; i < nr_cmds; i++) {
+		struct tcmu_work *work;
+
+		while (wq->head - wq->tail == wq->len) {
+			pthread_cond_broadcast(&wq->work_cond);
+			pthread_cond_wait(&wq->space_cond, &wq->lock);
+		}
+		work = &wq->works[wq->head++ % wq->len];
+		work->dev = dev;
+		work->cmd = cmds[i];
+		work->fn = fn;
+	}
+
+	if (nr_cmds > 1)
+		pthread_cond_broadcast(&wq->work_cond);
+	else
+		pthread_cond_signal(&wq->work_cond);
+
+	pthread_cleanup_pop(1);
+}
+
+unsigned int tcmur_queue_room(struct tcmu_work_queue *wq,
+			      struct tcmu_device *dev, tcmur_room_fn fn)
+{
+	struct tcmu_device **waiter;
+	unsigned int ret;
+
+	pthread_mutex_lock(&wq->lock);
+	ret = room(wq);
+	if (!ret) {
+		wq->room_fn = fn;
+		darray_foreach(waiter, wq->waiting) {
+			if (*waiter == dev)
+				goto out;
+		}
+		darray_append(wq->waiting, dev);
+	}
+out:
+	pthread_mutex_unlock(&wq->lock);
+
+	return ret;
+}
+
+void tcmur_submit_work(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       tcmur_work_fn fn)
+{
+	struct tcmur_dispatch *d = tcmur_get_dispatch(dev);
+	int ret;
+
+	/* No async workers for this device, so it's just a call */
+	if (!d->async_wq) {
+		ret = fn(dev, cmd);
+		if (ret != TCMU_ASYNC_HANDLED)
+			tcmur_cmd_complete(dev, cmd, ret);
+		return;
+	}
+
+	tcmur_queue_commands(d->async_wq, dev, &cmd, fn, 1);
+}
+
+int tcmur_set_async_limits(struct tcmu_device *dev, unsigned int nr_threads,
+			   unsigned int queue_len)
+{
+	struct tcmur_dispatch *d = tcmur_get_dispatch(dev);
+
+	/* Only from ->open(), the workers are started after it */
+	if (d->async_wq)
+		return -EBUSY;
+
+	d->nr_async_threads = nr_threads;
+	d->async_queue_len = queue_len;
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Running commands through a tcmu-runner handler: the registered
+ * handlers and the version of the API each has, calling them,
+ * completing what they handled, and the work queues that run commands
+ * on threads of their own, for --workers and tcmur_submit_work().
+ * Shared by tcmu-runner and tcmu-bench, so the benchmark measures the
+ * runner's own command path.
+ */
+
+#ifndef __TCMU_DISPATCH_H
+#define __TCMU_DISPATCH_H
+
+#include "darray.h"
+#include "tcmu-runner.h"
+#include "libtcmu.h"
+
+/* Max commands taken off a device's ring and handled per batch */
+#define TCMUR_CMD_BURST 32
+
+/* Commands the devices can have queued for the --workers */
+#define TCMUR_WORK_QUEUE_LEN 1024
+
+/* Queue depth of a handler's async workers, if it doesn't say */
+#define TCMUR_ASYNC_QUEUE_LEN 128
+
+struct tcmu_work_queue;
+
+/* Per device, kept by whoever runs the device's commands */
+struct tcmur_dispatch {
+	unsigned int handler_version;	/* as registered, see tcmu-runner.h */
+	struct tcmu_work_queue *wq;	/* NULL if commands are run inline */
+	struct tcmu_work_queue *async_wq; /* for tcmur_submit_work(), or NULL */
+	unsigned int nr_async_threads;
+	unsigned int async_queue_len;
+};
+
+/* The program using this provides the device's struct tcmur_dispatch */
+struct tcmur_dispatch *tcmur_get_dispatch(struct tcmu_device *dev);
+
+/* A registered handler, and the version of struct tcmur_handler it has */
+struct runner_handler {
+	struct tcmur_handler *handler;
+	unsigned int version;
+};
+
+typedef darray(struct runner_handler) darray_runner_handler;
+
+/* Filled in by the handlers' handler_init(), see tcmur_open_handler() */
+extern darray_runner_handler g_runner_handlers;
+
+/* Whether dbgp() prints anything */
+extern bool tcmur_debug;
+
+/*
+ * Which version of struct tcmur_handler the handler registered with.
+ * Fields past handle_cmd must not be looked at for version 0, they
+ * aren't there.
+ */
+unsigned int tcmur_handler_version(struct tcmur_handler *handler);
+
+/* Load the handler module at path, which registers its handlers */
+int tcmur_open_handler(const char *path);
+
+/*
+ * Fill in what d needs from the device's handler, before its open(),
+ * which may then still change it with tcmur_set_async_limits().
+ */
+void tcmur_dispatch_init(struct tcmur_dispatch *d, struct tcmur_handler *handler);
+
+/*
+ * After the device's open(), get it the --workers if nr_workers isn't 0
+ * and its handler is multi_threaded, and its async workers if it has
+ * any. Each is shared with the other devices that use the same.
+ */
+int tcmur_dispatch_start(struct tcmu_device *dev, struct tcmur_dispatch *d,
+			 unsigned int nr_workers);
+/*
+ * Wait until none of the device's work is queued or running, and let
+ * go of its workers. Nothing may queue more for it by then.
+ */
+void tcmur_dispatch_stop(struct tcmu_device *dev, struct tcmur_dispatch *d);
+
+/*
+ * Run up to TCMUR_CMD_BURST commands through the handler, or through
+ * the work functions they were submitted with if fns is given. Returns
+ * how many were completed; the caller passes them on to the kernel with
+ * tcmulib_processing_complete().
+ */
+int tcmur_handle_commands(struct tcmu_device *dev, struct tcmulib_cmd **cmds,
+			  tcmur_work_fn *fns, int nr_cmds);
+
+/*
+ * count workers running the commands queued for them, len at most,
+ * for any number of devices. Whoever asks with the same key, count and
+ * len gets the same ones; they're started for the first and stopped
+ * once the last puts them.
+ */
+struct tcmu_work_queue *tcmur_get_workers(const void *key, int count,
+					  unsigned int len);
+void tcmur_put_workers(struct tcmu_work_queue *wq);
+
+/* Wait until none of the device's commands are queued or running */
+void tcmur_flush_workers(struct tcmu_work_queue *wq, struct tcmu_device *dev);
+
+/*
+ * Queue the device's commands for the workers, to run through fn or
+ * handle_cmd. Waits for room if the queue is full, see
+ * tcmur_queue_room().
+ */
+void tcmur_queue_commands(struct tcmu_work_queue *wq, struct tcmu_device *dev,
+			  struct tcmulib_cmd **cmds, tcmur_work_fn fn,
+			  int nr_cmds);
+
+typedef void (*tcmur_room_fn)(struct tcmu_device *dev);
+
+/*
+ * How many commands can be queued without waiting. If none, fn is
+ * called for the device from a worker once a good part of the queue is
+ * free again, for a thread that mustn't wait to leave commands on the
+ * ring until then.
+ */
+unsigned int tcmur_queue_room(struct tcmu_work_queue *wq,
+			      struct tcmu_device *dev, tcmur_room_fn fn);
+
+#endif
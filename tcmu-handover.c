@@ -0,0 +1,358 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "tcmu-runner.h"
+#include "tcmu-handover.h"
+
+#define HANDOVER_MAGIC		0x484d4354	/* "TCMH" */
+#define HANDOVER_VERSION	2
+
+/*
+ * Longest either side waits for the other. The old runner may take a
+ * while to stop a device whose handler is slow to finish its commands,
+ * and the new one to open a device's backend between claims.
+ */
+#define HANDOVER_TIMEOUT_MS	30000
+
+enum {
+	HANDOVER_HELLO,		/* new to old, let's go */
+	HANDOVER_CLAIM,		/* new to old, send dev_name over */
+	HANDOVER_DEV,		/* old to new, with the uio fd */
+	HANDOVER_NODEV,		/* old to new, don't have it */
+	HANDOVER_DONE,		/* new to old, that's all */
+};
+
+/* Same layout on both sides, whatever they were built from */
+struct handover_msg {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;
+	uint32_t cmd_tail;
+	char dev_name[16];
+	char uio_name[512];
+};
+
+static tcmur_handover_fn handover_fn;
+
+/* One claim at a time on the new runner's connection */
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int claim_err;	/* the connection failed, under claim_lock */
+
+static void set_timeouts(int fd)
+{
+	struct timeval tv = {
+		.tv_sec = HANDOVER_TIMEOUT_MS / 1000,
+		.tv_usec = (HANDOVER_TIMEOUT_MS % 1000) * 1000,
+	};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Returns 0, -errno, or -ECONNRESET if the other side hung up */
+static int send_msg(int sock, struct handover_msg *msg, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	msg->magic = HANDOVER_MAGIC;
+	msg->version = HANDOVER_VERSION;
+
+	if (fd != -1) {
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		ret = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		return errno == EPIPE ? -ECONNRESET : -errno;
+	if (ret != sizeof(*msg))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Like send_msg(). *fd is set to the fd that came with the message,
+ * or -1.
+ */
+static int recv_msg(int sock, struct handover_msg *msg, int *fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	*fd = -1;
+
+	do {
+		ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+		return -errno;
+	if (ret == 0)
+		return -ECONNRESET;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (ret != sizeof(*msg) || msg->magic != HANDOVER_MAGIC ||
+	    msg->version != HANDOVER_VERSION) {
+		if (*fd != -1)
+			close(*fd);
+		*fd = -1;
+		return -EPROTO;
+	}
+
+	msg->dev_name[sizeof(msg->dev_name) - 1] = '\0';
+	msg->uio_name[sizeof(msg->uio_name) - 1] = '\0';
+	return 0;
+}
+
+int tcmur_handover_serve(int sock, tcmur_release_fn fn)
+{
+	struct handover_msg msg;
+	struct tcmulib_handover h;
+	int nr_devs = 0;
+	int fd, ret;
+
+	while (1) {
+		ret = recv_msg(sock, &msg, &fd);
+		if (fd != -1)
+			close(fd);
+		if (ret)
+			break;
+
+		if (msg.type == HANDOVER_DONE)
+			break;
+
+		if (msg.type != HANDOVER_CLAIM) {
+			errp("handover: unexpected message %u\n", msg.type);
+			continue;
+		}
+
+		if (fn(msg.dev_name, &h)) {
+			msg.type = HANDOVER_NODEV;
+			ret = send_msg(sock, &msg, -1);
+		} else {
+			msg.type = HANDOVER_DEV;
+			msg.cmd_tail = h.cmd_tail;
+			snprintf(msg.uio_name, sizeof(msg.uio_name), "%s", h.uio_name);
+			ret = send_msg(sock, &msg, h.fd);
+			close(h.fd);
+			if (!ret)
+				nr_devs++;
+		}
+		if (ret)
+			break;
+	}
+
+	close(sock);
+
+	return ret ? ret : nr_devs;
+}
+
+void tcmur_handover_done(int sock)
+{
+	struct handover_msg msg = { .type = HANDOVER_DONE };
+	int ret;
+
+	ret = send_msg(sock, &msg, -1);
+	if (ret)
+		errp("handover: could not tell the old runner we're done: %d\n", ret);
+	close(sock);
+}
+
+static gboolean handover_listen_cb(GIOChannel *source, GIOCondition condition,
+				   gpointer data)
+{
+	int listen_fd = GPOINTER_TO_INT(data);
+	struct handover_msg msg;
+	int sock, fd, ret;
+
+	sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			errp("handover: accept failed: %m\n");
+		return TRUE;
+	}
+
+	/* Blocks the main loop, but a new runner says hello right away */
+	set_timeouts(sock);
+	ret = recv_msg(sock, &msg, &fd);
+	if (fd != -1)
+		close(fd);
+	if (ret || msg.type != HANDOVER_HELLO) {
+		errp("handover: bad hello from a new runner: %d\n", ret);
+		close(sock);
+		return TRUE;
+	}
+
+	dbgp("handing devices over to a new runner\n");
+	handover_fn(sock);
+
+	return TRUE;
+}
+
+int tcmur_handover_listen(const char *path, tcmur_handover_fn fn)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	GIOChannel *channel;
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	/* Left over from an earlier run, or the runner we took over from */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+	    listen(fd, 1) == -1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	handover_fn = fn;
+
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_IN, handover_listen_cb, GINT_TO_POINTER(fd));
+	g_io_channel_unref(channel);
+
+	return 0;
+}
+
+int tcmur_handover_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct handover_msg msg = { .type = HANDOVER_HELLO };
+	int sock, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -errno;
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		ret = -errno;
+		close(sock);
+		/* Nobody to take over from */
+		if (ret == -ECONNREFUSED)
+			return -ENOENT;
+		return ret;
+	}
+
+	set_timeouts(sock);
+
+	ret = send_msg(sock, &msg, -1);
+	if (ret) {
+		close(sock);
+		return ret;
+	}
+
+	return sock;
+}
+
+int tcmur_handover_claim(const char *dev_name, struct tcmulib_handover *h,
+			 void *data)
+{
+	struct handover_msg msg = { .type = HANDOVER_CLAIM };
+	int sock = GPOINTER_TO_INT(data);
+	int fd = -1;
+	int ret;
+
+	snprintf(msg.dev_name, sizeof(msg.dev_name), "%s", dev_name);
+
+	pthread_mutex_lock(&claim_lock);
+	/* The old runner keeps whatever it still has, nothing to claim */
+	ret = claim_err;
+	if (!ret)
+		ret = send_msg(sock, &msg, -1);
+	if (!ret)
+		ret = recv_msg(sock, &msg, &fd);
+	if (ret)
+		claim_err = ret;
+	pthread_mutex_unlock(&claim_lock);
+
+	if (ret)
+		return ret;
+
+	if (msg.type == HANDOVER_NODEV) {
+		if (fd != -1)
+			close(fd);
+		return 1;
+	}
+
+	if (msg.type != HANDOVER_DEV || fd == -1 ||
+	    strcmp(msg.dev_name, dev_name)) {
+		errp("handover: unexpected message %u for %s\n", msg.type,
+		     dev_name);
+		if (fd != -1)
+			close(fd);
+		return -EPROTO;
+	}
+
+	memset(h, 0, sizeof(*h));
+	snprintf(h->dev_name, sizeof(h->dev_name), "%s", msg.dev_name);
+	snprintf(h->uio_name, sizeof(h->uio_name), "%s", msg.uio_name);
+	h->cmd_tail = msg.cmd_tail;
+	h->fd = fd;
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Handing devices over to a new tcmu-runner (--handover-socket).
+ *
+ * A runner listens on the unix socket. A new runner given the same
+ * path connects to it before looking for devices and says hello, and
+ * then claims each device it finds as it comes to open it. The old one
+ * stops just that device once every command it took off the ring has
+ * been completed, and sends its uio fd over with SCM_RIGHTS along with
+ * where it got to on the ring, while its other devices carry on. The
+ * new one opens the device's backend and carries on with it without
+ * the kernel seeing it go away (see tcmulib_initialize_handover()).
+ * Once it has opened them all it says it's done, and the old one
+ * exits. The new one then listens on the socket for the next upgrade.
+ */
+
+#ifndef __TCMU_HANDOVER_H
+#define __TCMU_HANDOVER_H
+
+#include "libtcmu.h"
+
+/*
+ * Called from the main loop with a new runner's connection, once it
+ * said hello. Should give the devices up with tcmur_handover_serve().
+ */
+typedef void (*tcmur_handover_fn)(int sock);
+
+/* Listen on path, replacing whatever is there. Returns 0 or -errno. */
+int tcmur_handover_listen(const char *path, tcmur_handover_fn fn);
+
+/*
+ * Give up the device the new runner claimed, filling in h. Returns 0,
+ * 1 if we don't have it, or -errno. h->fd is closed once it's sent.
+ */
+typedef int (*tcmur_release_fn)(const char *dev_name,
+				struct tcmulib_handover *h);
+
+/*
+ * Give devices up to the new runner one at a time, as it claims them,
+ * until it says it's done, and hang up. Returns how many it got, or
+ * -errno if it went away first.
+ */
+int tcmur_handover_serve(int sock, tcmur_release_fn fn);
+
+/*
+ * Connect to a runner listening on path and say hello. Returns the
+ * connection, -ENOENT if no runner is listening, or -errno.
+ */
+int tcmur_handover_connect(const char *path);
+
+/*
+ * A tcmulib_claim_fn, with the connection as data: claim a device from
+ * the old runner. May be called from several threads at once.
+ */
+int tcmur_handover_claim(const char *dev_name, struct tcmulib_handover *h,
+			 void *data);
+
+/* Tell the old runner we have all we want, and hang up */
+void tcmur_handover_done(int sock);
+
+#endif
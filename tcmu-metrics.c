@@ -0,0 +1,345 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "tcmu-runner.h"
+#include "tcmu-metrics.h"
+
+/* Longest a scraper may keep the main loop waiting on a full socket */
+#define METRICS_SEND_TIMEOUT_MS 1000
+
+static tcmur_metrics_collect_fn metrics_collect;
+
+static const char *class_names[TCMULIB_CMD_CLASSES] = {
+	[TCMULIB_CMD_OTHER] = "other",
+	[TCMULIB_CMD_READ] = "read",
+	[TCMULIB_CMD_WRITE] = "write",
+	[TCMULIB_CMD_FLUSH] = "flush",
+};
+
+static const double quantiles[TCMUR_METRICS_QUANTILES] = { 50, 99, 99.9 };
+
+void tcmur_metrics_read_dev(struct tcmu_device *dev,
+			    struct tcmur_dev_metrics *m)
+{
+	struct tcmulib_ring_stats ring;
+	struct tcmulib_lat_hist *hist;
+	int i, q;
+
+	snprintf(m->device, sizeof(m->device), "%s", tcmu_get_dev_cfgstring(dev));
+
+	tcmulib_get_cmd_stats(dev, &m->cmds);
+
+	tcmulib_get_ring_stats(dev, &ring);
+	m->ring_size = ring.ring_size;
+	m->ring_max_fill = ring.max_fill;
+
+	hist = malloc(sizeof(*hist));
+	if (!hist)
+		return;
+
+	for (i = 0; i < TCMULIB_CMD_CLASSES; i++) {
+		tcmulib_get_latency_stats(dev, i, hist);
+		m->lat_sum_ns[i] = hist->sum_ns;
+		for (q = 0; q < TCMUR_METRICS_QUANTILES; q++)
+			m->lat_ns[i][q] = tcmulib_lat_percentile(hist, quantiles[q]);
+	}
+
+	free(hist);
+}
+
+/* Label values may hold anything, escape what the format needs */
+static void print_label(FILE *f, const char *val)
+{
+	for (; *val; val++) {
+		if (*val == '\\' || *val == '"')
+			fprintf(f, "\\%c", *val);
+		else if (*val == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*val, f);
+	}
+}
+
+static void print_header(FILE *f, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void print_sample(FILE *f, const char *name, struct tcmur_dev_metrics *m,
+			 const char *extra, unsigned long long val)
+{
+	fprintf(f, "%s{device=\"", name);
+	print_label(f, m->device);
+	fprintf(f, "\"%s} %llu\n", extra ? extra : "", val);
+}
+
+/* One sample per device of the uint64_t at off in struct tcmur_dev_metrics */
+static void print_u64(FILE *f, struct tcmur_dev_metrics *devs, int count,
+		      const char *name, const char *type, const char *help,
+		      size_t off, bool busy_poll)
+{
+	int i;
+
+	print_header(f, name, type, help);
+	for (i = 0; i < count; i++) {
+		if (busy_poll && !devs[i].busy_poll)
+			continue;
+		print_sample(f, name, &devs[i], NULL,
+			     *(uint64_t *) ((char *) &devs[i] + off));
+	}
+}
+
+static void print_metrics(FILE *f, struct tcmur_dev_metrics *devs, int count)
+{
+	char extra[64];
+	int i, c, q;
+
+	print_header(f, "tcmu_commands_total", "counter",
+		     "Commands completed, by class.");
+	for (i = 0; i < count; i++) {
+		for (c = 0; c < TCMULIB_CMD_CLASSES; c++) {
+			snprintf(extra, sizeof(extra), ",class=\"%s\"", class_names[c]);
+			print_sample(f, "tcmu_commands_total", &devs[i], extra,
+				     devs[i].cmds.cmds[c]);
+		}
+	}
+
+	print_u64(f, devs, count, "tcmu_read_bytes_total", "counter",
+		  "Bytes read by commands that completed with GOOD status.",
+		  offsetof(struct tcmur_dev_metrics, cmds.bytes_read), false);
+	print_u64(f, devs, count, "tcmu_written_bytes_total", "counter",
+		  "Bytes written by commands that completed with GOOD status.",
+		  offsetof(struct tcmur_dev_metrics, cmds.bytes_written), false);
+	print_u64(f, devs, count, "tcmu_not_handled_total", "counter",
+		  "Commands the handler did not handle.",
+		  offsetof(struct tcmur_dev_metrics, cmds.not_handled), false);
+	print_u64(f, devs, count, "tcmu_check_condition_total", "counter",
+		  "Commands completed with CHECK CONDITION status.",
+		  offsetof(struct tcmur_dev_metrics, cmds.check_condition), false);
+
+	print_header(f, "tcmu_inflight_commands", "gauge",
+		     "Commands taken off the ring and not yet completed.");
+	for (i = 0; i < count; i++)
+		print_sample(f, "tcmu_inflight_commands", &devs[i], NULL,
+			     devs[i].cmds.inflight);
+
+	print_header(f, "tcmu_ring_size_bytes", "gauge",
+		     "Size of the command ring.");
+	for (i = 0; i < count; i++)
+		print_sample(f, "tcmu_ring_size_bytes", &devs[i], NULL,
+			     devs[i].ring_size);
+
+	print_header(f, "tcmu_ring_max_fill_bytes", "gauge",
+		     "Most of the command ring seen in use.");
+	for (i = 0; i < count; i++)
+		print_sample(f, "tcmu_ring_max_fill_bytes", &devs[i], NULL,
+			     devs[i].ring_max_fill);
+
+	print_header(f, "tcmu_command_latency_seconds", "summary",
+		     "Time from taking a command off the ring to completing it.");
+	for (i = 0; i < count; i++) {
+		for (c = 0; c < TCMULIB_CMD_CLASSES; c++) {
+			for (q = 0; q < TCMUR_METRICS_QUANTILES; q++) {
+				fputs("tcmu_command_latency_seconds{device=\"", f);
+				print_label(f, devs[i].device);
+				fprintf(f, "\",class=\"%s\",quantile=\"%g\"} %.9f\n",
+					class_names[c], quantiles[q] / 100,
+					devs[i].lat_ns[c][q] / 1e9);
+			}
+			fputs("tcmu_command_latency_seconds_sum{device=\"", f);
+			print_label(f, devs[i].device);
+			fprintf(f, "\",class=\"%s\"} %.9f\n", class_names[c],
+				devs[i].lat_sum_ns[c] / 1e9);
+			snprintf(extra, sizeof(extra), ",class=\"%s\"", class_names[c]);
+			print_sample(f, "tcmu_command_latency_seconds_count",
+				     &devs[i], extra, devs[i].cmds.cmds[c]);
+		}
+	}
+
+	print_u64(f, devs, count, "tcmu_busy_poll_spin_nanoseconds_total", "counter",
+		  "Time spent spinning on the ring for commands.",
+		  offsetof(struct tcmur_dev_metrics, spin_ns), true);
+	print_u64(f, devs, count, "tcmu_busy_poll_sleep_nanoseconds_total", "counter",
+		  "Time spent asleep waiting for commands.",
+		  offsetof(struct tcmur_dev_metrics, sleep_ns), true);
+	print_u64(f, devs, count, "tcmu_busy_poll_hits_total", "counter",
+		  "Spins that found commands.",
+		  offsetof(struct tcmur_dev_metrics, spin_hits), true);
+	print_u64(f, devs, count, "tcmu_busy_poll_misses_total", "counter",
+		  "Spins that gave up and went to sleep.",
+		  offsetof(struct tcmur_dev_metrics, spin_misses), true);
+	print_u64(f, devs, count, "tcmu_busy_poll_sleeps_total", "counter",
+		  "Times the device thread slept waiting for commands.",
+		  offsetof(struct tcmur_dev_metrics, sleeps), true);
+
+	print_u64(f, devs, count, "tcmu_qos_iops_limit", "gauge",
+		  "Commands per second the device is limited to, 0 for no limit.",
+		  offsetof(struct tcmur_dev_metrics, qos_iops), false);
+	print_u64(f, devs, count, "tcmu_qos_bytes_limit", "gauge",
+		  "Bytes per second the device is limited to, 0 for no limit.",
+		  offsetof(struct tcmur_dev_metrics, qos_bps), false);
+	print_u64(f, devs, count, "tcmu_qos_weight", "gauge",
+		  "The device's share of its event loop, relative to 100.",
+		  offsetof(struct tcmur_dev_metrics, qos_weight), false);
+	print_u64(f, devs, count, "tcmu_qos_throttled_total", "counter",
+		  "Commands held back for being over the device's limits.",
+		  offsetof(struct tcmur_dev_metrics, qos_throttled), false);
+	print_u64(f, devs, count, "tcmu_qos_throttled_nanoseconds_total", "counter",
+		  "Time commands were held back, summed.",
+		  offsetof(struct tcmur_dev_metrics, qos_throttled_ns), false);
+	print_u64(f, devs, count, "tcmu_qos_held_commands", "gauge",
+		  "Commands held back right now.",
+		  offsetof(struct tcmur_dev_metrics, qos_held), false);
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			dbgp("metrics: send failed: %m\n");
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* The client sent its request, whatever it is; answer and hang up */
+static gboolean metrics_client_cb(GIOChannel *source, GIOCondition condition,
+				  gpointer data)
+{
+	int fd = GPOINTER_TO_INT(data);
+	struct timeval tv = {
+		.tv_sec = METRICS_SEND_TIMEOUT_MS / 1000,
+		.tv_usec = (METRICS_SEND_TIMEOUT_MS % 1000) * 1000,
+	};
+	struct tcmur_dev_metrics *devs;
+	char req[1024];
+	char *body = NULL;
+	size_t body_len = 0;
+	char header[128];
+	FILE *f;
+	int count;
+
+	/* Only one response per connection, what was asked doesn't matter */
+	if (read(fd, req, sizeof(req)) <= 0)
+		goto out;
+
+	devs = metrics_collect(&count);
+	if (!devs) {
+		errp("metrics: could not collect device metrics\n");
+		goto out;
+	}
+
+	f = open_memstream(&body, &body_len);
+	if (!f) {
+		free(devs);
+		goto out;
+	}
+	print_metrics(f, devs, count);
+	fclose(f);
+	free(devs);
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\n\r\n", body_len);
+
+	/* Blocking from here, but not for long */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	send_all(fd, header, strlen(header));
+	send_all(fd, body, body_len);
+	free(body);
+
+out:
+	close(fd);
+	return FALSE;
+}
+
+static gboolean metrics_listen_cb(GIOChannel *source, GIOCondition condition,
+				  gpointer data)
+{
+	int listen_fd = GPOINTER_TO_INT(data);
+	GIOChannel *channel;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		channel = g_io_channel_unix_new(fd);
+		g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			       metrics_client_cb, GINT_TO_POINTER(fd));
+		g_io_channel_unref(channel);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		errp("metrics: accept failed: %m\n");
+
+	return TRUE;
+}
+
+int tcmur_metrics_start(const char *path, tcmur_metrics_collect_fn collect)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	GIOChannel *channel;
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	/* Left over from an earlier run */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+	    listen(fd, 16) == -1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	metrics_collect = collect;
+
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_IN, metrics_listen_cb, GINT_TO_POINTER(fd));
+	g_io_channel_unref(channel);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * tcmu-runner's metrics endpoint (--metrics-socket).
+ *
+ * Each connection to the unix socket gets one HTTP response with every
+ * device's counters in Prometheus' text format, then is closed, so it
+ * can be scraped with e.g. curl --unix-socket. Everything is served
+ * from the glib main loop. The numbers come from libtcmu's lock-free
+ * counters and from the device threads' own stats, so scraping never
+ * holds up I/O.
+ */
+
+#ifndef __TCMU_METRICS_H
+#define __TCMU_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libtcmu.h"
+
+/* Quantiles reported for each command class's latency */
+#define TCMUR_METRICS_QUANTILES 3
+
+/* One device's numbers for a scrape */
+struct tcmur_dev_metrics {
+	char device[256];	/* its cfgstring */
+
+	/* From libtcmu, see tcmur_metrics_read_dev() */
+	struct tcmulib_cmd_stats cmds;
+	uint32_t ring_size;
+	uint32_t ring_max_fill;
+	uint64_t lat_sum_ns[TCMULIB_CMD_CLASSES];
+	uint64_t lat_ns[TCMULIB_CMD_CLASSES][TCMUR_METRICS_QUANTILES];
+
+	/* From tcmu-runner's busy polling, if on for the device */
+	bool busy_poll;
+	uint64_t spin_ns;
+	uint64_t sleep_ns;
+	uint64_t spin_hits;
+	uint64_t spin_misses;
+	uint64_t sleeps;
+
+	/* From tcmu-runner's QoS, see tcmu-qos.h */
+	uint64_t qos_iops;
+	uint64_t qos_bps;
+	uint64_t qos_weight;
+	uint64_t qos_throttled;
+	uint64_t qos_throttled_ns;
+	uint64_t qos_held;
+};
+
+/* Fill in the device name and what libtcmu keeps for dev */
+void tcmur_metrics_read_dev(struct tcmu_device *dev,
+			    struct tcmur_dev_metrics *m);
+
+/*
+ * Gather every device's metrics for a scrape, into a malloc()ed array
+ * whose length goes in *count. Returns NULL on failure. Called from
+ * the main loop.
+ */
+typedef struct tcmur_dev_metrics *(*tcmur_metrics_collect_fn)(int *count);
+
+/*
+ * Listen on a unix socket at path, replacing whatever is there, and
+ * serve metrics from the glib main loop. Returns 0 or -errno.
+ */
+int tcmur_metrics_start(const char *path, tcmur_metrics_collect_fn collect);
+
+#endif
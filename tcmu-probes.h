@@ -0,0 +1,79 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Static tracepoints (USDT probes) in libtcmu, tcmu-runner and the
+ * handlers, under the provider name "tcmu".
+ *
+ * When built with sys/sdt.h (systemtap's, see CMakeLists.txt) each
+ * probe is a single nop plus an ELF note saying where its arguments
+ * are, which perf, bpftrace or systemtap turn into a breakpoint only
+ * while something is attached, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/lib64/libtcmu.so.1:tcmu:cmd_complete
+ *                /arg4 > 1000000/ { printf("%d %d\n", arg2, arg4); }'
+ *
+ * Without sys/sdt.h they compile to nothing and their arguments aren't
+ * evaluated, so don't give them any with side effects.
+ *
+ * In libtcmu and tcmu-runner the first argument is always the struct
+ * tcmu_device pointer and the second the command's cmd_id, which
+ * together identify a command from dequeue to completion:
+ *
+ *   cmd_dequeue(dev, cmd_id, opcode, lba, xfer_len)
+ *   cmd_complete(dev, cmd_id, opcode, status, latency_ns)
+ *   handler_entry(dev, cmd_id, opcode)
+ *   handler_return(dev, cmd_id, result)
+ *
+ * status is the SAM status, or TCMU_NOT_HANDLED, and latency_ns the
+ * time since cmd_dequeue. handler_return's result may also be
+ * TCMU_ASYNC_HANDLED, with cmd_complete to follow from elsewhere.
+ *
+ * The qcow handler's metadata paths, by image file offset:
+ *
+ *   qcow_l2_miss(l2_offset)		L2 table read into the cache
+ *   qcow_alloc(offset, size)		cluster or L2 table allocated, 0 if
+ *					that failed
+ *   qcow_cow(old_offset, new_offset)	shared cluster copied for a write
+ */
+
+#ifndef __TCMU_PROBES_H
+#define __TCMU_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TCMU_PROBE1(name, a1) \
+	DTRACE_PROBE1(tcmu, name, a1)
+#define TCMU_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(tcmu, name, a1, a2)
+#define TCMU_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(tcmu, name, a1, a2, a3)
+#define TCMU_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(tcmu, name, a1, a2, a3, a4)
+#define TCMU_PROBE5(name, a1, a2, a3, a4, a5) \
+	DTRACE_PROBE5(tcmu, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define TCMU_PROBE1(name, a1) do { } while (0)
+#define TCMU_PROBE2(name, a1, a2) do { } while (0)
+#define TCMU_PROBE3(name, a1, a2, a3) do { } while (0)
+#define TCMU_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define TCMU_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
+
+#endif
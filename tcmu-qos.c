@@ -0,0 +1,164 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "tcmu-qos.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Used for bursts left at 0 */
+#define QOS_DEFAULT_BURST_NS (NSEC_PER_SEC / 10)
+
+/*
+ * Longest a device waits to try commands held back again, so it soon
+ * sees new limits.
+ */
+#define QOS_RECHECK_NS (NSEC_PER_SEC / 10)
+
+/* Nanoseconds per command or byte at rate, in 32.32 fixed point */
+static uint64_t ns_fp(uint64_t rate)
+{
+	return rate ? (NSEC_PER_SEC << 32) / rate : 0;
+}
+
+static uint64_t cost_ns(uint64_t amount, uint64_t fp)
+{
+	unsigned __int128 ns = ((unsigned __int128) amount * fp) >> 32;
+
+	return ns > UINT64_MAX ? UINT64_MAX : ns;
+}
+
+/*
+ * How long until a bucket that's full at full_ns has room for cost,
+ * 0 if it has now. It can go burst_ns into debt, so a command costing
+ * more than the whole burst goes once the bucket is full.
+ */
+static uint64_t bucket_wait(uint64_t full_ns, uint64_t burst_ns,
+			    uint64_t cost, uint64_t now)
+{
+	uint64_t need = full_ns > now ? full_ns - now : 0;
+
+	need += cost < burst_ns ? cost : burst_ns;
+	return need > burst_ns ? need - burst_ns : 0;
+}
+
+static void bucket_take(uint64_t *full_ns, uint64_t cost, uint64_t now)
+{
+	*full_ns = (*full_ns > now ? *full_ns : now) + cost;
+}
+
+void tcmur_qos_init(struct tcmur_qos *q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	q->new_limits.weight = TCMUR_QOS_WEIGHT_DEFAULT;
+	q->limits.weight = TCMUR_QOS_WEIGHT_DEFAULT;
+}
+
+void tcmur_qos_destroy(struct tcmur_qos *q)
+{
+	pthread_mutex_destroy(&q->lock);
+}
+
+int tcmur_qos_set(struct tcmur_qos *q, const struct tcmur_qos_limits *limits)
+{
+	if (limits->weight > TCMUR_QOS_WEIGHT_MAX)
+		return -EINVAL;
+	if ((limits->iops_burst && !limits->iops) ||
+	    (limits->bps_burst && !limits->bps))
+		return -EINVAL;
+
+	pthread_mutex_lock(&q->lock);
+	q->new_limits = *limits;
+	if (!q->new_limits.weight)
+		q->new_limits.weight = TCMUR_QOS_WEIGHT_DEFAULT;
+	__atomic_store_n(&q->changed, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+void tcmur_qos_get(struct tcmur_qos *q, struct tcmur_qos_limits *limits)
+{
+	pthread_mutex_lock(&q->lock);
+	*limits = q->new_limits;
+	pthread_mutex_unlock(&q->lock);
+}
+
+void tcmur_qos_apply(struct tcmur_qos *q)
+{
+	struct tcmur_qos_limits *l = &q->limits;
+
+	pthread_mutex_lock(&q->lock);
+	*l = q->new_limits;
+	__atomic_store_n(&q->changed, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->lock);
+
+	q->iops_ns_fp = ns_fp(l->iops);
+	q->bps_ns_fp = ns_fp(l->bps);
+	q->iops_burst_ns = l->iops_burst ?
+		cost_ns(l->iops_burst, q->iops_ns_fp) : QOS_DEFAULT_BURST_NS;
+	q->bps_burst_ns = l->bps_burst ?
+		cost_ns(l->bps_burst, q->bps_ns_fp) : QOS_DEFAULT_BURST_NS;
+
+	/* New limits start with full buckets */
+	q->iops_full_ns = 0;
+	q->bps_full_ns = 0;
+
+	q->active = l->iops || l->bps;
+}
+
+int tcmur_qos_admit(struct tcmur_qos *q, struct tcmulib_cmd **cmds,
+		    int nr_cmds, uint64_t now)
+{
+	uint64_t iops_cost = cost_ns(1, q->iops_ns_fp);
+	uint64_t bps_cost, wait, bps_wait;
+	int i;
+
+	for (i = 0; i < nr_cmds; i++) {
+		bps_cost = cost_ns(cmds[i]->data_len, q->bps_ns_fp);
+
+		wait = bucket_wait(q->iops_full_ns, q->iops_burst_ns,
+				   iops_cost, now);
+		bps_wait = bucket_wait(q->bps_full_ns, q->bps_burst_ns,
+				       bps_cost, now);
+		if (bps_wait > wait)
+			wait = bps_wait;
+		if (wait) {
+			q->next_ns = now + (wait < QOS_RECHECK_NS ?
+					    wait : QOS_RECHECK_NS);
+			break;
+		}
+
+		bucket_take(&q->iops_full_ns, iops_cost, now);
+		bucket_take(&q->bps_full_ns, bps_cost, now);
+	}
+
+	return i;
+}
+
+int tcmur_qos_timeout(struct tcmur_qos *q, uint64_t now)
+{
+	uint64_t us;
+
+	if (q->next_ns <= now)
+		return 0;
+
+	us = (q->next_ns - now + 999) / 1000;
+	return us > INT_MAX ? INT_MAX : us;
+}
@@ -0,0 +1,122 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Per-device QoS in tcmu-runner: IOPS and bandwidth limits, each a
+ * token bucket, and a weight for the device's share of a shared loop.
+ *
+ * Commands are checked against the limits as they come off the ring,
+ * before the handler sees them. Those over the limits are held back
+ * until the buckets have room for them, never failed. The limits can
+ * be changed at any time, from any thread, with tcmur_qos_set(); the
+ * thread running the device's commands picks them up with its next
+ * batch.
+ */
+
+#ifndef __TCMU_QOS_H
+#define __TCMU_QOS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libtcmu.h"
+
+#define TCMUR_QOS_WEIGHT_DEFAULT 100
+#define TCMUR_QOS_WEIGHT_MAX 10000
+
+struct tcmur_qos_limits {
+	uint64_t iops;		/* commands per second, 0 for no limit */
+	uint64_t bps;		/* bytes per second, 0 for no limit */
+
+	/*
+	 * How far a device that was idle may go over its limits at
+	 * once, in commands and bytes. 0 for a tenth of a second's
+	 * worth.
+	 */
+	uint64_t iops_burst;
+	uint64_t bps_burst;
+
+	/* Share of a shared loop's time, relative to the default */
+	uint32_t weight;
+};
+
+struct tcmur_qos {
+	/* Set by tcmur_qos_set(), under lock */
+	pthread_mutex_t lock;
+	struct tcmur_qos_limits new_limits;
+	bool changed;
+
+	/* Only touched by the thread running the device's commands */
+	struct tcmur_qos_limits limits;
+	bool active;		/* there's a limit to check */
+
+	/*
+	 * Each bucket is kept as the time it will be full again, and
+	 * how much time its burst is worth at the limit's rate. A
+	 * command or byte costs *_ns_fp nanoseconds, in 32.32 fixed
+	 * point.
+	 */
+	uint64_t iops_full_ns;
+	uint64_t bps_full_ns;
+	uint64_t iops_burst_ns;
+	uint64_t bps_burst_ns;
+	uint64_t iops_ns_fp;
+	uint64_t bps_ns_fp;
+
+	uint64_t next_ns;	/* when to try the commands held back again */
+
+	/* Stats, racy reads are fine */
+	uint64_t throttled;	/* commands held back */
+	uint64_t throttled_ns;	/* time they were held back, summed */
+};
+
+void tcmur_qos_init(struct tcmur_qos *q);
+void tcmur_qos_destroy(struct tcmur_qos *q);
+
+/* Returns 0, or -EINVAL if the limits make no sense */
+int tcmur_qos_set(struct tcmur_qos *q, const struct tcmur_qos_limits *limits);
+
+/* The limits last set, which may not be in use quite yet */
+void tcmur_qos_get(struct tcmur_qos *q, struct tcmur_qos_limits *limits);
+
+/* Start using the limits last set, see tcmur_qos_update() */
+void tcmur_qos_apply(struct tcmur_qos *q);
+
+/*
+ * Pick up any new limits. Returns true if the device has limits to
+ * check its commands against.
+ */
+static inline bool tcmur_qos_update(struct tcmur_qos *q)
+{
+	if (__atomic_load_n(&q->changed, __ATOMIC_ACQUIRE))
+		tcmur_qos_apply(q);
+	return q->active;
+}
+
+/*
+ * How many of cmds, in order, are within the limits at now and may
+ * run, taking them out of the buckets. Once one isn't, none after it
+ * are either, and tcmur_qos_timeout() says when to try it again.
+ */
+int tcmur_qos_admit(struct tcmur_qos *q, struct tcmulib_cmd **cmds,
+		    int nr_cmds, uint64_t now);
+
+/*
+ * Microseconds from now, rounded up, until the commands held back
+ * should be tried again.
+ */
+int tcmur_qos_timeout(struct tcmur_qos *q, uint64_t now);
+
+#endif
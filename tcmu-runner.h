@@ -28,11 +28,22 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <sys/uio.h>
 #include "scsi_defs.h"
 
 #include "libtcmu_common.h"
 
+/*
+ * The version of struct tcmur_handler this header describes. Handlers
+ * register with tcmur_register_handler_version(handler,
+ * TCMUR_HANDLER_VERSION) to say they have the fields added since
+ * version 0. Those registered with tcmur_register_handler() are
+ * version 0, and only looked at up to handle_cmd, where the struct
+ * used to end.
+ */
+#define TCMUR_HANDLER_VERSION 1
+
 struct tcmur_handler {
 	const char *name;	/* Human-friendly name */
 	const char *subtype;	/* Name for cfgstring matching */
@@ -66,6 +77,53 @@ struct tcmur_handler {
 	 * - TCMU_ASYNC_HANDLED if optcode is handled asynchronously
 	 */
 	int (*handle_cmd)(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+
+	/*
+	 * Version 1. Set if handle_cmd may be called for the same device
+	 * from several threads at once. Only then will tcmu-runner spread
+	 * a device's commands over worker threads (--workers).
+	 */
+	bool multi_threaded;
+
+	/*
+	 * Version 1. Threads and queue length of the async workers the
+	 * handler's devices share, see tcmur_submit_work(). With no
+	 * threads, submitted work is run right away on the calling
+	 * thread. open() can pick other values per device with
+	 * tcmur_set_async_limits(); devices given the same share workers.
+	 */
+	unsigned int nr_async_threads;
+	unsigned int async_queue_len;	/* default 128 */
+
+	/*
+	 * Version 1, optional. Handle a batch of commands taken off the
+	 * ring together, in the order they came off it, so the handler
+	 * can merge them or submit their I/O at once. Sets results[i] to
+	 * what handle_cmd would have returned for cmds[i]. When set,
+	 * tcmu-runner calls it instead of handle_cmd. handle_cmd must
+	 * still be set, for runners that predate version 1.
+	 */
+	void (*handle_cmds)(struct tcmu_device *dev, struct tcmulib_cmd **cmds,
+			    int *results, int nr_cmds);
+
+	/*
+	 * Version 1. Set if open() may be called for several devices at
+	 * once, from threads other than the main one. tcmu-runner then
+	 * opens the devices that already exist when it starts in
+	 * parallel, rather than one after another.
+	 */
+	bool parallel_open;
+
+	/*
+	 * Version 1. Set if handle_cmd and handle_cmds never block: they
+	 * only start the commands' I/O, e.g. with tcmur_submit_work() and
+	 * async threads or a library's own async calls, and the commands
+	 * are completed later with tcmur_cmd_complete(). Only then may
+	 * tcmu-runner serve the handler's devices from event loops that
+	 * other devices share (--loop-threads). Otherwise each device gets
+	 * a thread of its own, unless its commands run on --workers.
+	 */
+	bool nonblocking;
 };
 
 /*
@@ -78,7 +136,67 @@ void tcmur_handler_init(void);
  * APIs for tcmur only
  */
 void tcmur_register_handler(struct tcmur_handler *handler);
+/* For handlers that set fields past handle_cmd, see TCMUR_HANDLER_VERSION */
+void tcmur_register_handler_version(struct tcmur_handler *handler,
+				    unsigned int version);
 bool tcmur_unregister_handler(struct tcmur_handler *handler);
+
+enum {
+	TCMUR_IO_READ,
+	TCMUR_IO_WRITE,
+};
+
+/*
+ * Called when I/O queued with tcmur_queue_io() is done. ret is what
+ * preadv()/pwritev() would have returned, or -errno. Returns the SCSI
+ * status to complete the command with.
+ */
+typedef int (*tcmur_io_done_fn)(struct tcmu_device *dev,
+				struct tcmulib_cmd *cmd, ssize_t ret);
+
+/*
+ * Read from or write to fd at offset, using the command's iovec, then
+ * complete the command with what done() returns. With tcmu-runner's
+ * io_uring engine this is queued on the calling thread's ring;
+ * otherwise the I/O is done before returning. Either way, handle_cmd
+ * must then return TCMU_ASYNC_HANDLED.
+ */
+void tcmur_queue_io(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		    int op, int fd, off_t offset, tcmur_io_done_fn done);
+
+/*
+ * Work run on one of the device's async workers. Returns the SCSI
+ * status to complete the command with, or TCMU_ASYNC_HANDLED if it
+ * will be completed later with tcmur_cmd_complete().
+ */
+typedef int (*tcmur_work_fn)(struct tcmu_device *dev, struct tcmulib_cmd *cmd);
+
+/*
+ * Queue fn to run for cmd on the device's async workers; handle_cmd
+ * must then return TCMU_ASYNC_HANDLED. If the queue is full, this
+ * waits for room. For nonblocking handlers, tcmu-runner takes no more
+ * commands off the ring than the queue has room for, so submitting at
+ * most one fn per command never waits. The workers complete what
+ * several commands' fn return together, so the kernel is notified
+ * once for all of them. Close is only called once all queued work has
+ * run.
+ */
+void tcmur_submit_work(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		       tcmur_work_fn fn);
+
+/*
+ * Complete a command handle_cmd or a tcmur_work_fn returned
+ * TCMU_ASYNC_HANDLED for. Can be called from any thread.
+ */
+void tcmur_cmd_complete(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			int result);
+
+/*
+ * Override the handler's nr_async_threads and async_queue_len for one
+ * device. Only valid from open(). 0 queue length means the default.
+ */
+int tcmur_set_async_limits(struct tcmu_device *dev, unsigned int nr_threads,
+			   unsigned int queue_len);
 void dbgp(const char *fmt, ...);
 void errp(const char *fmt, ...);
 
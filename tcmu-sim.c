@@ -0,0 +1,430 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#define _BITS_UIO_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
+#include <scsi/scsi.h>
+
+#include <linux/target_core_user.h>
+
+#include "libtcmu_priv.h"
+#include "tcmu-sim.h"
+
+/* The kernel hands out the data area in blocks of this size */
+#define SIM_DATA_BLOCK	4096
+#define SIM_CDB_LEN	16
+/* Longest to wait for the last commands once the run is over */
+#define SIM_DRAIN_MS	10000
+
+struct sim_slot {
+	bool busy;
+	uint64_t submit_ns;
+};
+
+struct tcmu_sim {
+	struct tcmu_sim_config cfg;
+
+	struct tcmu_mailbox *mb;
+	size_t map_len;
+	uint32_t cmdr_size;
+	size_t data_off;
+	size_t io_span;		/* io_size rounded up to data blocks */
+	unsigned int iov_cnt;	/* data blocks per command */
+	uint32_t ent_len;
+
+	uint32_t tail;		/* up to where completions were reaped */
+
+	int fds[2];		/* [0] is ours, [1] stands in for the uio fd */
+
+	struct sim_slot *slots;	/* indexed by cmd_id - 1 */
+	uint16_t *free_slots;
+	unsigned int nr_free;
+
+	uint64_t rand;
+};
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough to spread LBAs and pick reads or writes */
+static uint64_t sim_rand(struct tcmu_sim *sim)
+{
+	sim->rand ^= sim->rand >> 12;
+	sim->rand ^= sim->rand << 25;
+	sim->rand ^= sim->rand >> 27;
+	return sim->rand * 2685821657736338717ULL;
+}
+
+struct tcmu_sim *tcmu_sim_create(const struct tcmu_sim_config *cfg)
+{
+	struct tcmu_sim *sim;
+	size_t ent_len;
+	int i;
+
+	if (!cfg->queue_depth || cfg->queue_depth > UINT16_MAX ||
+	    !cfg->block_size || !cfg->io_size ||
+	    cfg->io_size % cfg->block_size ||
+	    cfg->dev_size < cfg->io_size || cfg->read_pct > 100)
+		return NULL;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->cfg = *cfg;
+	sim->rand = now_ns(CLOCK_MONOTONIC) | 1;
+
+	sim->io_span = (cfg->io_size + SIM_DATA_BLOCK - 1) & ~(SIM_DATA_BLOCK - 1);
+	sim->iov_cnt = sim->io_span / SIM_DATA_BLOCK;
+
+	/* Laid out like the kernel does: iovecs, then the CDB */
+	ent_len = offsetof(struct tcmu_cmd_entry, req.iov) +
+		sim->iov_cnt * sizeof(struct iovec);
+	if (ent_len < sizeof(struct tcmu_cmd_entry))
+		ent_len = sizeof(struct tcmu_cmd_entry);
+	ent_len += SIM_CDB_LEN;
+	sim->ent_len = (ent_len + TCMU_OP_ALIGN_SIZE - 1) & ~(TCMU_OP_ALIGN_SIZE - 1);
+
+	/* Room for every command plus wrap-around padding */
+	sim->cmdr_size = 2 * cfg->queue_depth * sim->ent_len;
+	if (sim->cmdr_size < 64 * 1024)
+		sim->cmdr_size = 64 * 1024;
+	sim->cmdr_size = (sim->cmdr_size + SIM_DATA_BLOCK - 1) & ~(SIM_DATA_BLOCK - 1);
+
+	sim->data_off = SIM_DATA_BLOCK + sim->cmdr_size;
+	sim->map_len = sim->data_off + cfg->queue_depth * sim->io_span;
+
+	sim->mb = mmap(NULL, sim->map_len, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (sim->mb == MAP_FAILED)
+		goto err_free;
+
+	sim->mb->version = KERN_IFACE_VER;
+	sim->mb->cmdr_off = SIM_DATA_BLOCK;
+	sim->mb->cmdr_size = sim->cmdr_size;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       0, sim->fds) == -1)
+		goto err_munmap;
+
+	sim->slots = calloc(cfg->queue_depth, sizeof(*sim->slots));
+	sim->free_slots = calloc(cfg->queue_depth, sizeof(*sim->free_slots));
+	if (!sim->slots || !sim->free_slots)
+		goto err_close;
+
+	for (i = 0; i < cfg->queue_depth; i++)
+		sim->free_slots[sim->nr_free++] = cfg->queue_depth - 1 - i;
+
+	return sim;
+
+err_close:
+	free(sim->free_slots);
+	free(sim->slots);
+	close(sim->fds[0]);
+	close(sim->fds[1]);
+err_munmap:
+	munmap(sim->mb, sim->map_len);
+err_free:
+	free(sim);
+	return NULL;
+}
+
+void tcmu_sim_destroy(struct tcmu_sim *sim)
+{
+	free(sim->free_slots);
+	free(sim->slots);
+	close(sim->fds[0]);
+	close(sim->fds[1]);
+	munmap(sim->mb, sim->map_len);
+	free(sim);
+}
+
+int tcmu_sim_get_fd(struct tcmu_sim *sim)
+{
+	return sim->fds[1];
+}
+
+void *tcmu_sim_get_map(struct tcmu_sim *sim, size_t *map_len)
+{
+	*map_len = sim->map_len;
+	return sim->mb;
+}
+
+void tcmu_sim_kick(struct tcmu_sim *sim)
+{
+	uint32_t buf = 0;
+
+	if (write(sim->fds[0], &buf, sizeof(buf)) == -1 && errno != EAGAIN)
+		perror("tcmu-sim: doorbell");
+}
+
+/*
+ * uio only has one pending event however often it's raised, so only
+ * ring again once libtcmu has read the last one.
+ */
+static void ring_doorbell(struct tcmu_sim *sim)
+{
+	int unread;
+
+	if (ioctl(sim->fds[0], SIOCOUTQ, &unread) == 0 && unread)
+		return;
+
+	tcmu_sim_kick(sim);
+}
+
+static struct tcmu_cmd_entry *ring_entry(struct tcmu_sim *sim, uint32_t off)
+{
+	return (void *) sim->mb + sim->mb->cmdr_off + off;
+}
+
+static uint32_t ring_free(struct tcmu_sim *sim, uint32_t head)
+{
+	return (sim->tail - head - 1 + sim->cmdr_size) % sim->cmdr_size;
+}
+
+/* Queue one command, returns false if the ring is full */
+static bool queue_cmd(struct tcmu_sim *sim, struct tcmu_sim_stats *stats)
+{
+	struct tcmu_sim_config *cfg = &sim->cfg;
+	struct tcmu_cmd_entry *ent;
+	uint32_t head = sim->mb->cmd_head;
+	uint32_t pad = 0;
+	uint32_t len_op;
+	uint64_t nr_ios, lba;
+	size_t data;
+	uint8_t *cdb;
+	uint16_t slot;
+	bool is_read;
+	int i;
+
+	if (head + sim->ent_len > sim->cmdr_size)
+		pad = sim->cmdr_size - head;
+	if (ring_free(sim, head) < pad + sim->ent_len)
+		return false;
+
+	/* Entries don't wrap, skip to the start of the ring */
+	if (pad) {
+		len_op = pad;
+		tcmu_hdr_set_op(&len_op, TCMU_OP_PAD);
+		ring_entry(sim, head)->hdr.len_op = len_op;
+		head = 0;
+	}
+
+	slot = sim->free_slots[--sim->nr_free];
+	data = sim->data_off + slot * sim->io_span;
+
+	ent = ring_entry(sim, head);
+	memset(ent, 0, sim->ent_len);
+	len_op = sim->ent_len;
+	tcmu_hdr_set_op(&len_op, TCMU_OP_CMD);
+	ent->hdr.len_op = len_op;
+	ent->hdr.cmd_id = slot + 1;
+
+	ent->req.iov_cnt = sim->iov_cnt;
+	for (i = 0; i < sim->iov_cnt; i++) {
+		ent->req.iov[i].iov_base = (void *) (data + i * SIM_DATA_BLOCK);
+		ent->req.iov[i].iov_len = SIM_DATA_BLOCK;
+	}
+	ent->req.iov[sim->iov_cnt - 1].iov_len -= sim->io_span - cfg->io_size;
+
+	cdb = (uint8_t *) ent + sim->ent_len - SIM_CDB_LEN;
+	ent->req.cdb_off = cdb - (uint8_t *) sim->mb;
+
+	is_read = sim_rand(sim) % 100 < cfg->read_pct;
+	nr_ios = cfg->dev_size / cfg->io_size;
+	lba = (sim_rand(sim) % nr_ios) * (cfg->io_size / cfg->block_size);
+
+	cdb[0] = is_read ? READ_16 : WRITE_16;
+	*(uint64_t *) &cdb[2] = htobe64(lba);
+	*(uint32_t *) &cdb[10] = htobe32(cfg->io_size / cfg->block_size);
+
+	if (is_read)
+		stats->reads++;
+	else
+		stats->writes++;
+
+	sim->slots[slot].busy = true;
+	sim->slots[slot].submit_ns = now_ns(CLOCK_MONOTONIC);
+
+	/* The entry must be complete before libtcmu can see it */
+	__atomic_store_n(&sim->mb->cmd_head, (head + sim->ent_len) % sim->cmdr_size,
+			 __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < (1 << TCMU_SIM_LAT_SUB_BITS))
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - TCMU_SIM_LAT_SUB_BITS + 1) << TCMU_SIM_LAT_SUB_BITS) |
+		((ns >> (msb - TCMU_SIM_LAT_SUB_BITS)) & ((1 << TCMU_SIM_LAT_SUB_BITS) - 1));
+}
+
+static uint64_t lat_bucket_ns(unsigned int bucket)
+{
+	unsigned int shift = bucket >> TCMU_SIM_LAT_SUB_BITS;
+	uint64_t sub = bucket & ((1 << TCMU_SIM_LAT_SUB_BITS) - 1);
+
+	if (!shift)
+		return sub;
+
+	return ((1ULL << TCMU_SIM_LAT_SUB_BITS) | sub) << (shift - 1);
+}
+
+uint64_t tcmu_sim_percentile(const struct tcmu_sim_stats *stats, double pct)
+{
+	uint64_t total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < TCMU_SIM_LAT_BUCKETS; i++)
+		total += stats->lat_hist[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < TCMU_SIM_LAT_BUCKETS; i++) {
+		seen += stats->lat_hist[i];
+		if (seen * 100.0 >= total * pct)
+			return lat_bucket_ns(i);
+	}
+
+	return stats->lat_max_ns;
+}
+
+/* Reap what libtcmu completed, like the kernel does on a doorbell */
+static int reap_cmds(struct tcmu_sim *sim, struct tcmu_sim_stats *stats)
+{
+	struct tcmu_cmd_entry *ent;
+	uint32_t cmd_tail;
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	uint64_t lat;
+	uint16_t slot;
+	int reaped = 0;
+
+	cmd_tail = __atomic_load_n(&sim->mb->cmd_tail, __ATOMIC_ACQUIRE);
+
+	while (sim->tail != cmd_tail) {
+		ent = ring_entry(sim, sim->tail);
+		sim->tail = (sim->tail + tcmu_hdr_get_len(ent->hdr.len_op)) % sim->cmdr_size;
+
+		if (tcmu_hdr_get_op(ent->hdr.len_op) != TCMU_OP_CMD)
+			continue;
+
+		slot = ent->hdr.cmd_id - 1;
+		if (slot >= sim->cfg.queue_depth || !sim->slots[slot].busy) {
+			fprintf(stderr, "tcmu-sim: completion for unknown cmd_id %u\n",
+				ent->hdr.cmd_id);
+			stats->errors++;
+			continue;
+		}
+
+		if (ent->rsp.scsi_status != SAM_STAT_GOOD ||
+		    ent->hdr.uflags & TCMU_UFLAG_UNKNOWN_OP)
+			stats->errors++;
+
+		lat = now - sim->slots[slot].submit_ns;
+		stats->lat_hist[lat_bucket(lat)]++;
+		if (!stats->lat_min_ns || lat < stats->lat_min_ns)
+			stats->lat_min_ns = lat;
+		if (lat > stats->lat_max_ns)
+			stats->lat_max_ns = lat;
+
+		sim->slots[slot].busy = false;
+		sim->free_slots[sim->nr_free++] = slot;
+		reaped++;
+	}
+
+	return reaped;
+}
+
+/* Wait for libtcmu's doorbell, and swallow however many there were */
+static void wait_doorbell(struct tcmu_sim *sim, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = sim->fds[0], .events = POLLIN };
+	char buf[256];
+
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return;
+
+	while (read(sim->fds[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+int tcmu_sim_run(struct tcmu_sim *sim, unsigned int duration_ms,
+		 struct tcmu_sim_stats *stats)
+{
+	uint64_t start, end, cpu_start;
+	int queued;
+
+	memset(stats, 0, sizeof(*stats));
+
+	cpu_start = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	start = now_ns(CLOCK_MONOTONIC);
+	end = start + duration_ms * 1000000ULL;
+
+	while (now_ns(CLOCK_MONOTONIC) < end) {
+		queued = 0;
+		while (sim->nr_free && queue_cmd(sim, stats))
+			queued++;
+		if (queued)
+			ring_doorbell(sim);
+
+		wait_doorbell(sim, 10);
+		reap_cmds(sim, stats);
+	}
+
+	/* Let what's in flight finish */
+	end = now_ns(CLOCK_MONOTONIC) + SIM_DRAIN_MS * 1000000ULL;
+	while (sim->nr_free != sim->cfg.queue_depth &&
+	       now_ns(CLOCK_MONOTONIC) < end) {
+		wait_doorbell(sim, 10);
+		reap_cmds(sim, stats);
+	}
+
+	stats->elapsed_ns = now_ns(CLOCK_MONOTONIC) - start;
+	stats->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+	if (sim->nr_free != sim->cfg.queue_depth) {
+		fprintf(stderr, "tcmu-sim: %u commands never completed\n",
+			sim->cfg.queue_depth - sim->nr_free);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
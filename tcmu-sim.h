@@ -0,0 +1,79 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * A userspace stand-in for target_core_user's side of a device, so
+ * libtcmu's ring path can be driven without the kernel module.
+ *
+ * It lays out a mailbox, command ring and data area in anonymous shared
+ * memory, queues READ_16/WRITE_16 commands on the ring the way the
+ * kernel does, and reaps their completions. One end of a socketpair
+ * stands in for the uio fd: the simulator writes to its end when it
+ * queues commands, and libtcmu's doorbell writes show up on it.
+ */
+
+#ifndef __TCMU_SIM_H
+#define __TCMU_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Latency histogram: 16 linear steps per power of two of ns */
+#define TCMU_SIM_LAT_SUB_BITS	4
+#define TCMU_SIM_LAT_BUCKETS	(64 << TCMU_SIM_LAT_SUB_BITS)
+
+struct tcmu_sim_config {
+	unsigned int queue_depth;	/* commands kept in flight */
+	unsigned int io_size;		/* bytes per command */
+	unsigned int read_pct;		/* share of reads, 0-100 */
+	unsigned int block_size;
+	long long dev_size;		/* bytes, LBAs are picked uniformly */
+};
+
+struct tcmu_sim_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t errors;	/* completed with other than GOOD status */
+	uint64_t elapsed_ns;
+	uint64_t cpu_ns;	/* used by the simulator itself */
+	uint64_t lat_min_ns;
+	uint64_t lat_max_ns;
+	uint64_t lat_hist[TCMU_SIM_LAT_BUCKETS];
+};
+
+struct tcmu_sim;
+
+struct tcmu_sim *tcmu_sim_create(const struct tcmu_sim_config *cfg);
+void tcmu_sim_destroy(struct tcmu_sim *sim);
+
+/* What to hand libtcmu in place of the uio fd and mapping */
+int tcmu_sim_get_fd(struct tcmu_sim *sim);
+void *tcmu_sim_get_map(struct tcmu_sim *sim, size_t *map_len);
+
+/*
+ * Keep queue_depth commands in flight for duration_ms, then wait for
+ * the last of them to complete. Runs on the calling thread. Returns 0,
+ * or -ETIMEDOUT if commands were still outstanding after 10s.
+ */
+int tcmu_sim_run(struct tcmu_sim *sim, unsigned int duration_ms,
+		 struct tcmu_sim_stats *stats);
+
+/* Ring the doorbell without queueing anything, e.g. to stop a poller */
+void tcmu_sim_kick(struct tcmu_sim *sim);
+
+/* Latency at or below which pct percent of commands completed */
+uint64_t tcmu_sim_percentile(const struct tcmu_sim_stats *stats, double pct);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <liburing.h>
+
+#include "libtcmu.h"
+#include "tcmu-uring.h"
+
+/* Handler I/O a ring can have outstanding; beyond that it's done inline */
+#define TCMUR_URING_IOS 256
+#define TCMUR_URING_DEPTH (TCMUR_URING_IOS + 8)
+
+/* user_data of the ring's own requests, handler I/O uses a pointer */
+#define URING_TAG_UIO		1
+#define URING_TAG_WAKE		2
+#define URING_TAG_NOTIFY	3
+
+struct tcmur_uring_io {
+	struct tcmu_device *dev;
+	struct tcmulib_cmd *cmd;
+	tcmur_io_done_fn done;
+	struct tcmur_uring_io *next;
+};
+
+struct tcmur_uring {
+	struct io_uring ring;
+	struct tcmu_device *dev;
+	int wake_fd;
+
+	uint32_t notify_buf;
+	uint64_t wake_buf;
+
+	struct tcmur_uring_io ios[TCMUR_URING_IOS];
+	struct tcmur_uring_io *free_ios;
+};
+
+/* The ring of the device thread we're running on, if any */
+static __thread struct tcmur_uring *thread_ring;
+
+static struct io_uring_sqe *get_sqe(struct tcmur_uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&r->ring);
+	if (!sqe) {
+		/* Full, make room */
+		io_uring_submit(&r->ring);
+		sqe = io_uring_get_sqe(&r->ring);
+	}
+
+	return sqe;
+}
+
+static int arm_read(struct tcmur_uring *r, int fd, void *buf, unsigned len,
+		    uintptr_t tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_read(sqe, fd, buf, len, 0);
+	io_uring_sqe_set_data(sqe, (void *) tag);
+
+	return 0;
+}
+
+/*
+ * The uio fd is non-blocking, so a read of it on the ring would come
+ * straight back with -EAGAIN. Wait for it to be readable instead.
+ */
+static int arm_poll(struct tcmur_uring *r, int fd, uintptr_t tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_poll_add(sqe, fd, POLLIN);
+	io_uring_sqe_set_data(sqe, (void *) tag);
+
+	return 0;
+}
+
+static void notify_hook(struct tcmu_device *dev, void *data)
+{
+	struct tcmur_uring *r = data;
+	struct io_uring_sqe *sqe = NULL;
+	uint32_t buf = 0;
+
+	/* Only the owning thread may touch the ring */
+	if (thread_ring == r)
+		sqe = get_sqe(r);
+
+	if (!sqe) {
+		if (write(tcmu_get_dev_fd(dev), &buf, 4) == -1 && errno != EAGAIN)
+			errp("could not notify kernel: %m\n");
+		return;
+	}
+
+	io_uring_prep_write(sqe, tcmu_get_dev_fd(dev), &r->notify_buf, 4, 0);
+	io_uring_sqe_set_data(sqe, (void *) URING_TAG_NOTIFY);
+}
+
+struct tcmur_uring *tcmur_uring_setup(struct tcmu_device *dev, int wake_fd)
+{
+	struct tcmur_uring *r;
+	int ret;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	ret = io_uring_queue_init(TCMUR_URING_DEPTH, &r->ring, 0);
+	if (ret) {
+		errp("could not set up io_uring: %d\n", ret);
+		free(r);
+		return NULL;
+	}
+
+	r->dev = dev;
+	r->wake_fd = wake_fd;
+
+	for (i = 0; i < TCMUR_URING_IOS; i++) {
+		r->ios[i].next = r->free_ios;
+		r->free_ios = &r->ios[i];
+	}
+
+	arm_poll(r, tcmu_get_dev_fd(dev), URING_TAG_UIO);
+	arm_read(r, wake_fd, &r->wake_buf, sizeof(r->wake_buf), URING_TAG_WAKE);
+
+	thread_ring = r;
+	tcmulib_set_notify_hook(dev, notify_hook, r);
+
+	return r;
+}
+
+void tcmur_uring_teardown(struct tcmur_uring *r)
+{
+	tcmulib_set_notify_hook(r->dev, NULL, NULL);
+	thread_ring = NULL;
+
+	io_uring_queue_exit(&r->ring);
+	free(r);
+}
+
+bool tcmur_uring_queue_io(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int op, int fd, off_t offset, tcmur_io_done_fn done)
+{
+	struct tcmur_uring *r = thread_ring;
+	struct tcmur_uring_io *io;
+	struct io_uring_sqe *sqe;
+
+	if (!r || r->dev != dev || !r->free_ios)
+		return false;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return false;
+
+	io = r->free_ios;
+	r->free_ios = io->next;
+	io->dev = dev;
+	io->cmd = cmd;
+	io->done = done;
+
+	if (cmd->flags & TCMULIB_CMD_CONTIGUOUS && cmd->iov_cnt) {
+		if (op == TCMUR_IO_READ)
+			io_uring_prep_read(sqe, fd, cmd->iovec[0].iov_base,
+					   cmd->iovec[0].iov_len, offset);
+		else
+			io_uring_prep_write(sqe, fd, cmd->iovec[0].iov_base,
+					    cmd->iovec[0].iov_len, offset);
+	} else if (op == TCMUR_IO_READ) {
+		io_uring_prep_readv(sqe, fd, cmd->iovec, cmd->iov_cnt, offset);
+	} else {
+		io_uring_prep_writev(sqe, fd, cmd->iovec, cmd->iov_cnt, offset);
+	}
+	io_uring_sqe_set_data(sqe, io);
+
+	return true;
+}
+
+int tcmur_uring_wait(struct tcmur_uring *r, int timeout_us)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	struct tcmur_uring_io *io;
+	unsigned int head, seen = 0;
+	int completed = 0;
+	int got_cmds = 0;
+	int ret;
+
+	if (timeout_us >= 0) {
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		ret = io_uring_submit_and_wait_timeout(&r->ring, &cqe, 1, &ts, NULL);
+	} else {
+		ret = io_uring_submit_and_wait_timeout(&r->ring, &cqe, 1, NULL, NULL);
+	}
+
+	if (ret == -ETIME) {
+		tcmulib_processing_complete(r->dev);
+		return 0;
+	}
+	if (ret < 0 && ret != -EINTR)
+		return ret;
+
+	io_uring_for_each_cqe(&r->ring, head, cqe) {
+		uintptr_t tag = (uintptr_t) io_uring_cqe_get_data(cqe);
+
+		seen++;
+
+		switch (tag) {
+		case URING_TAG_UIO:
+			if (cqe->res < 0) {
+				if (cqe->res != -EINTR && cqe->res != -ECANCELED)
+					errp("uio poll failed: %d\n", cqe->res);
+			} else if (cqe->res & POLLIN) {
+				/* Clear the event before looking at the ring */
+				tcmulib_processing_start(r->dev);
+				got_cmds = 1;
+			}
+			arm_poll(r, tcmu_get_dev_fd(r->dev), URING_TAG_UIO);
+			break;
+		case URING_TAG_WAKE:
+			arm_read(r, r->wake_fd, &r->wake_buf,
+				 sizeof(r->wake_buf), URING_TAG_WAKE);
+			break;
+		case URING_TAG_NOTIFY:
+			if (cqe->res < 0 && cqe->res != -EAGAIN)
+				errp("could not notify kernel: %d\n", cqe->res);
+			break;
+		default:
+			io = (struct tcmur_uring_io *) tag;
+			tcmulib_command_complete(io->dev, io->cmd,
+						 io->done(io->dev, io->cmd, cqe->res));
+			completed++;
+
+			io->next = r->free_ios;
+			r->free_ios = io;
+		}
+	}
+	io_uring_cq_advance(&r->ring, seen);
+
+	if (completed) {
+		tcmulib_processing_complete(r->dev);
+		/* Get the notification out now, not with the next batch */
+		if (io_uring_sq_ready(&r->ring))
+			io_uring_submit(&r->ring);
+	}
+
+	return got_cmds;
+}
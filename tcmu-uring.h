@@ -0,0 +1,57 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * tcmu-runner's io_uring engine, only built with -Dwith-io_uring=true.
+ *
+ * A device thread using it waits on one ring for everything: a read of
+ * the uio fd (which both waits for and acks the kernel's doorbell),
+ * handler I/O queued with tcmur_queue_io(), and the write to the uio
+ * fd that tells the kernel about completions.
+ */
+
+#ifndef __TCMU_URING_H
+#define __TCMU_URING_H
+
+#include <stdbool.h>
+
+#include "tcmu-runner.h"
+
+struct tcmur_uring;
+
+/*
+ * Set up a ring for dev, owned by the calling thread. wake_fd is an
+ * eventfd other threads write to, to get tcmur_uring_wait() to return.
+ */
+struct tcmur_uring *tcmur_uring_setup(struct tcmu_device *dev, int wake_fd);
+void tcmur_uring_teardown(struct tcmur_uring *r);
+
+/*
+ * Submit what's queued and wait up to timeout_us (-1 for no limit)
+ * for the device to have new commands, completing handler I/O that
+ * finishes meanwhile. Flushes held back notifications on timeout.
+ *
+ * Returns 1 if there are commands, 0 on timeout or wakeup, -errno on
+ * failure.
+ */
+int tcmur_uring_wait(struct tcmur_uring *r, int timeout_us);
+
+/*
+ * Queue I/O on the calling thread's ring, if it has one with room.
+ * Returns false if the caller should do the I/O itself.
+ */
+bool tcmur_uring_queue_io(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			  int op, int fd, off_t offset, tcmur_io_done_fn done);
+
+#endif